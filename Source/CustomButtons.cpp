@@ -12,8 +12,7 @@ void PatternButton::paintButton(juce::Graphics& g, bool, bool)
     g.fillAll(getToggleState() ? juce::Colours::white : juce::Colours::black);
     g.setColour(getToggleState() ? juce::Colours::black : juce::Colours::white);
 
-    char label[2] = { char(m_pattern) + 'A', 0 };
-    g.drawText(label, getLocalBounds(), juce::Justification::centred);
+    g.drawText(pattern_name(m_pattern), getLocalBounds(), juce::Justification::centred);
 }
 
 bool PatternButton::isInterestedInFileDrag(const juce::StringArray& files)
@@ -46,13 +45,13 @@ void PatternButton::mouseDrag(const juce::MouseEvent& event)
 	auto& pattern = m_editor->data().get_pattern(m_pattern);
 	std::vector<SequenceItem> sequence(1);
     sequence[0].pattern = m_pattern;
-    sequence[0].end_beat = pattern.time_signature.beats;
+    sequence[0].end_tick = pattern.time_signature.total_ticks();
 	drag_midi_sequence(sequence, m_editor->data(), get_suffix().c_str());
 }
 
 std::string PatternButton::get_suffix() const
 {
-    return std::format("_{}", (char)('A' + m_pattern));
+    return std::format("_{}", pattern_name(m_pattern));
 }
 
 void LaneButton::paintButton(juce::Graphics& g, bool shouldDrawButtonAsHighlighted, bool shouldDrawButtonAsDown)
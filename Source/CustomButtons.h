@@ -22,6 +22,9 @@ public:
 	void filesDropped(const juce::StringArray& files, int x, int y) override;
     void mouseDrag(const juce::MouseEvent& event) override;
 
+    int pattern() const { return m_pattern; }
+    void set_pattern(int pattern) { m_pattern = pattern; repaint(); }
+
 private:
 	std::string get_suffix() const;
 	DrummerQueenAudioProcessorEditor* m_editor = nullptr;
@@ -52,6 +55,8 @@ public:
     void paintButton(juce::Graphics& g,
         bool	shouldDrawButtonAsHighlighted,
         bool	shouldDrawButtonAsDown) override;
+    // Note sounding while the button is held, or -1
+    int m_audition_note = -1;
 };
 
 void draw_note_in_style(juce::Graphics& g, int style, int velocity, float x, float y, float size);
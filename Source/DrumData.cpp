@@ -4,142 +4,751 @@
 
 namespace
 {
-	std::vector<SequenceItem> parse_seq_impl(const char*& c) {
-		std::vector<SequenceItem> result;
-		int repeat = 1;
-		while (*c) {
-			if (isdigit(*c)) {
-				repeat = 0;
-				while (*c && isdigit(*c)) {
-					repeat = repeat * 10 + (*c - '0');
-					++c;
+	// Cleans up, checks and builds the sequence in one left to right pass. Open groups
+	// live on an explicit stack and their finished children on another, so nesting
+	// costs no recursion and each child is copied once, when its group closes.
+	// cleaned receives the upper cased text with anything meaningless dropped.
+	// A pattern is a single letter, or any pattern name in brackets, such as [AB].
+	std::shared_ptr<const Sequence> compile_sequence(std::string const& text, PatternBank const& patterns,
+		std::string& cleaned, SequenceError& error)
+	{
+		struct OpenGroup
+		{
+			std::int64_t repeat;
+			int first_child; // Index into children
+			int position; // Of the '(' in cleaned
+		};
+		std::vector<OpenGroup> groups;
+		std::vector<int> children;
+		groups.reserve(16);
+		children.reserve(text.size());
+		cleaned.clear();
+		cleaned.reserve(text.size());
+		error = {};
+
+		auto sequence = std::make_shared<Sequence>();
+		std::int64_t repeat = 1;
+		bool in_number = false;
+		auto fail = [&](int position, const char* message) {
+			if (!error) {
+				error = { position, message };
+			}
+			};
+		auto add = [&](int node) {
+			if (node >= 0) {
+				children.push_back(node);
+			}
+			if (!sequence->valid()) {
+				fail(int(cleaned.size()) - 1, "Song too long");
+			}
+			};
+		auto add_pattern = [&](int n, int position) {
+			if (n < 0 || n >= patterns.size()) {
+				fail(position, "Unknown pattern");
+				return;
+			}
+			add(sequence->add_leaf(n, repeat, patterns[n].time_signature.total_ticks()));
+			};
+
+		groups.push_back({ 1, 0, -1 });
+		int name_start = -1; // Of the '[' in cleaned while reading a name
+		for (unsigned char c : text) {
+			if (name_start >= 0) {
+				if (isalpha(c)) {
+					cleaned.push_back(char(toupper(c)));
+					continue;
+				}
+				if (c != ']' && !isdigit(c) && c != '(' && c != ')' && c != '[') {
+					continue;
+				}
+				if (c != ']') {
+					// Anything else ends the name without its ']'
+					fail(name_start, "Unclosed [");
+					name_start = -1;
 				}
 			}
-			else if (isalpha(*c)) {
-				auto n = tolower(*c) - 'a';
-				for (int i = 0; i < repeat; ++i) {
-					result.push_back({ 0.f, 0.f, n });
+			if (isdigit(c)) {
+				cleaned.push_back(char(c));
+				if (!in_number) {
+					repeat = 0;
+					in_number = true;
 				}
-				repeat = 1;
-				++c;
+				// Saturate before the multiply can overflow. The song is then too long.
+				int digit = c - '0';
+				repeat = repeat > (Sequence::MAX_LENGTH_TICKS - digit) / 10 ? Sequence::MAX_LENGTH_TICKS : repeat * 10 + digit;
+				continue;
 			}
-			else if (*c == '(') {
-				++c;
-				auto nested = parse_seq_impl(c);
-				for (int i = 0; i < repeat; ++i) {
-					result.insert(result.end(), nested.begin(), nested.end());
+			if (isalpha(c)) {
+				cleaned.push_back(char(toupper(c)));
+				add_pattern(toupper(c) - 'A', int(cleaned.size()) - 1);
+			}
+			else if (c == '[') {
+				cleaned.push_back(char(c));
+				name_start = int(cleaned.size()) - 1;
+				continue;
+			}
+			else if (c == ']') {
+				cleaned.push_back(char(c));
+				if (name_start < 0) {
+					fail(int(cleaned.size()) - 1, "Unmatched ]");
+				}
+				else {
+					auto name = std::string_view(cleaned).substr(name_start + 1, cleaned.size() - name_start - 2);
+					add_pattern(pattern_from_name(name), name_start);
+					name_start = -1;
 				}
-				repeat = 1;
 			}
-			else if (*c == ')') {
-				++c;
-				return result;
+			else if (c == '(') {
+				cleaned.push_back(char(c));
+				groups.push_back({ repeat, int(children.size()), int(cleaned.size()) - 1 });
+			}
+			else if (c == ')') {
+				cleaned.push_back(char(c));
+				if (groups.size() == 1) {
+					fail(int(cleaned.size()) - 1, "Unmatched )");
+				}
+				else {
+					auto group = groups.back();
+					groups.pop_back();
+					int node = sequence->add_group(std::span<const int>(children).subspan(group.first_child), group.repeat);
+					children.resize(group.first_child);
+					add(node);
+				}
 			}
 			else {
-				++c;
+				continue;
 			}
+			repeat = 1;
+			in_number = false;
 		}
-		return result;
+		if (name_start >= 0) {
+			fail(name_start, "Unclosed [");
+		}
+		if (groups.size() > 1) {
+			fail(groups.back().position, "Unclosed (");
+		}
+		sequence->set_root(sequence->add_group(children, 1));
+		if (error || !sequence->valid()) {
+			fail(int(cleaned.size()) - 1, "Song too long");
+			return std::make_shared<const Sequence>();
+		}
+		return sequence;
 	}
 
-	std::vector<SequenceItem> parse_seq(const char* c, DrumData::PatternArray const &patterns) {
-		auto seq = parse_seq_impl(c);
-		double beat_time = 0.f;
-		for (auto& item : seq) {
-			if (item.pattern >= 0 && item.pattern < patterns.size()) {
-				item.start_beat = beat_time;
-				item.end_beat = item.start_beat + patterns[item.pattern].time_signature.beats;
-				beat_time = item.end_beat;
+	PatternDelta make_delta(int pattern_id, DrumPattern const& before, DrumPattern const& after)
+	{
+		PatternDelta delta;
+		delta.pattern = pattern_id;
+		delta.old_time_signature = before.time_signature;
+		delta.new_time_signature = after.time_signature;
+		delta.old_lane_count = before.lane_count;
+		delta.new_lane_count = after.lane_count;
+		for (int lane = 0; lane < MAX_LANES; ++lane) {
+			auto& b = before.lanes[lane];
+			auto& a = after.lanes[lane];
+			if (b == a) {
+				continue;
 			}
-			else {
-				item.start_beat = beat_time;
+			if (b.note != a.note) {
+				delta.notes.push_back({ std::uint8_t(lane), std::uint8_t(b.note), std::uint8_t(a.note) });
+			}
+			for (int division = 0; division < MAX_DIVISIONS; ++division) {
+				if (b.velocity[division] != a.velocity[division]) {
+					delta.cells.push_back({ std::uint8_t(lane), std::uint8_t(division), b.velocity[division], a.velocity[division] });
+				}
 			}
 		}
-		return seq;
+		delta.notes.shrink_to_fit();
+		delta.cells.shrink_to_fit();
+		return delta;
+	}
+
+	std::size_t first_event_at(DrumEvents const& events, std::int64_t from_tick)
+	{
+		auto e = std::lower_bound(events.begin(), events.end(), from_tick,
+			[](DrumEvent const& event, std::int64_t tick) { return event.tick < tick; });
+		return std::size_t(e - events.begin());
 	}
 
-	bool validate(const char* c) {
-		int paren_level = 0;
-		while (*c) {
-			if (*c == '(') {
-				++paren_level;
+	void build_note_table(DrumKit& kit, DrumKit const& fallback)
+	{
+		kit.notes = {};
+		auto add = [&kit](DrumKit const& source, std::uint8_t flag) {
+			for (std::size_t i = 0; i < source.drums.size(); ++i) {
+				int note = source.drums[i].note;
+				// The kit's own drums go in first, and the first drum listed for a note wins
+				if (note >= 0 && note < NUM_NOTES && kit.notes[note].flags == 0) {
+					kit.notes[note] = { std::uint16_t(i), flag };
+				}
 			}
-			else if (*c == ')') {
-				--paren_level;
-				if (paren_level < 0) {
-					return false;
+			};
+		add(kit, DrumKit::NOTE_IN_KIT);
+		if (&kit != &fallback) {
+			add(fallback, DrumKit::NOTE_IN_FALLBACK);
+		}
+	}
+
+	// Binary state: a 16 byte header of magic, format version, payload size and the
+	// payload's CRC-32, then the payload. Numbers are little endian varints.
+	const char STATE_MAGIC[4] = { 'D', 'Q', 'B', 'S' };
+	const std::uint16_t STATE_VERSION = 1;
+	const std::size_t STATE_HEADER_SIZE = 16;
+	enum StateFlags
+	{
+		STATE_PLAY_SEQUENCE = 1,
+		STATE_LOOKAHEAD_RENDER = 2,
+	};
+
+	std::uint32_t crc32(std::uint8_t const* data, std::size_t size)
+	{
+		static const auto table = [] {
+			std::array<std::uint32_t, 256> t{};
+			for (std::uint32_t i = 0; i < 256; ++i) {
+				std::uint32_t c = i;
+				for (int bit = 0; bit < 8; ++bit) {
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
 				}
+				t[i] = c;
 			}
-			++c;
+			return t;
+			}();
+		std::uint32_t crc = 0xffffffffu;
+		for (std::size_t i = 0; i < size; ++i) {
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
 		}
-		return paren_level == 0;
+		return crc ^ 0xffffffffu;
 	}
 
-	double count_seq_impl(const char*& c) {
-		double result = 0.;
-		int repeat = 1;
-		while (*c) {
-			if (isdigit(*c)) {
-				repeat = 0;
-				while (*c && isdigit(*c)) {
-					repeat = repeat * 10 + (*c - '0');
-					++c;
+	struct StateWriter
+	{
+		std::vector<std::uint8_t> bytes;
+
+		void fixed(std::uint64_t value, int size)
+		{
+			for (int i = 0; i < size; ++i, value >>= 8) {
+				bytes.push_back(std::uint8_t(value));
+			}
+		}
+		void varint(std::uint64_t value)
+		{
+			for (; value >= 0x80; value >>= 7) {
+				bytes.push_back(std::uint8_t(value | 0x80));
+			}
+			bytes.push_back(std::uint8_t(value));
+		}
+		void string(std::string const& s)
+		{
+			varint(s.size());
+			bytes.insert(bytes.end(), s.begin(), s.end());
+		}
+	};
+
+	// Reads past the end give zeros and clear ok, so callers check once at the end
+	struct StateReader
+	{
+		std::uint8_t const* c;
+		std::uint8_t const* end;
+		bool ok = true;
+
+		std::uint64_t fixed(int size)
+		{
+			if (end - c < size) {
+				ok = false;
+				return 0;
+			}
+			std::uint64_t value = 0;
+			for (int i = 0; i < size; ++i) {
+				value |= std::uint64_t(*c++) << (i * 8);
+			}
+			return value;
+		}
+		std::uint64_t varint()
+		{
+			std::uint64_t value = 0;
+			for (int shift = 0; shift < 64; shift += 7) {
+				if (c == end) {
+					break;
+				}
+				auto byte = *c++;
+				value |= std::uint64_t(byte & 0x7f) << shift;
+				if (!(byte & 0x80)) {
+					return value;
+				}
+			}
+			ok = false;
+			return 0;
+		}
+		// Bounded, so damaged data cannot ask for absurd sizes
+		int integer(int max)
+		{
+			auto value = varint();
+			if (value > std::uint64_t(max)) {
+				ok = false;
+				return 0;
+			}
+			return int(value);
+		}
+		std::string string()
+		{
+			auto size = varint();
+			if (size > std::uint64_t(end - c)) {
+				ok = false;
+				return {};
+			}
+			std::string s(reinterpret_cast<const char*>(c), std::size_t(size));
+			c += size;
+			return s;
+		}
+	};
+
+	// Everything a JSON state holds, gathered before any of it is applied.
+	// Keys arrive in any order (the writer sorts them, so "version" comes last),
+	// so anything that depends on the version is settled once parsing is done.
+	struct JsonState
+	{
+		struct Pattern
+		{
+			int index = -1; // -1 for the slot after the previous pattern
+			int same_as = -1;
+			bool has_time_signature = false;
+			DrumPattern pattern;
+		};
+		int version = 0;
+		TimeSignature time_signature; // Shared by every pattern before version 3
+		std::optional<std::string> midi_file_directory;
+		float swing = 0.5f;
+		bool lookahead_render = false;
+		bool play_sequence = false;
+		int current_pattern = 0;
+		std::string current_kit = "General MIDI";
+		int pattern_count = PATTERN_PAGE_SIZE;
+		std::string sequence;
+		std::vector<int> kit_notes; // Lane notes before version 1
+		std::vector<Pattern> patterns;
+	};
+
+	// Streams a JSON state straight into a JsonState, with no DOM in between
+	class JsonStateReader
+	{
+	public:
+		using json = nlohmann::json;
+		explicit JsonStateReader(JsonState& state) : m_state(state) { m_state.patterns.reserve(PATTERN_PAGE_SIZE); }
+
+		bool null() { return true; }
+		bool boolean(bool value)
+		{
+			if (top() == ROOT && m_key == "lookahead_render") {
+				m_state.lookahead_render = value;
+			}
+			else if (top() == ROOT && m_key == "play_sequence") {
+				m_state.play_sequence = value;
+			}
+			return true;
+		}
+		bool number_integer(json::number_integer_t value) { return number(double(value)); }
+		bool number_unsigned(json::number_unsigned_t value) { return number(double(value)); }
+		bool number_float(json::number_float_t value, json::string_t const&) { return number(value); }
+		bool string(json::string_t& value)
+		{
+			if (top() == ROOT) {
+				if (m_key == "midi_file_directory") {
+					m_state.midi_file_directory = std::move(value);
+				}
+				else if (m_key == "current_kit") {
+					m_state.current_kit = std::move(value);
+				}
+				else if (m_key == "sequence") {
+					m_state.sequence = std::move(value);
 				}
 			}
-			else if (isalpha(*c)) {
-				result += repeat;
-				repeat = 1;
-				++c;
+			return true;
+		}
+		bool binary(json::binary_t&) { return true; }
+		bool key(json::string_t& key)
+		{
+			m_key = std::move(key);
+			return true;
+		}
+		bool start_object(std::size_t)
+		{
+			auto parent = top();
+			auto context = SKIP;
+			if (m_contexts.empty()) {
+				context = ROOT;
 			}
-			else if (*c == '(') {
-				++c;
-				auto nested = count_seq_impl(c);
-				result += repeat * nested;
-				repeat = 1;
+			else if (parent == ROOT && m_key == "kit") {
+				context = KIT;
 			}
-			else if (*c == ')') {
-				++c;
-				return result;
+			else if (parent == KIT_DRUMS) {
+				m_state.kit_notes.push_back(0);
+				context = KIT_DRUM;
 			}
-			else {
-				++c;
+			else if (parent == PATTERNS) {
+				m_state.patterns.emplace_back();
+				context = PATTERN;
+			}
+			else if (parent == LANES && pattern().pattern.lane_count < MAX_LANES) {
+				pattern().pattern.add_lane(0);
+				m_division = 0;
+				context = LANE;
 			}
+			m_contexts.push_back(context);
+			return true;
 		}
+		bool end_object()
+		{
+			m_contexts.pop_back();
+			return true;
+		}
+		bool start_array(std::size_t)
+		{
+			auto parent = top();
+			auto context = SKIP;
+			if (parent == ROOT && m_key == "patterns") {
+				context = PATTERNS;
+			}
+			else if (parent == PATTERN && m_key == "lanes") {
+				context = LANES;
+			}
+			else if (parent == LANE && m_key == "velocity") {
+				context = VELOCITY;
+			}
+			else if (parent == LANE && m_key == "hits") {
+				context = HITS;
+			}
+			else if (parent == HITS) {
+				m_hit_field = 0;
+				context = HIT;
+			}
+			else if (parent == KIT && m_key == "drums") {
+				context = KIT_DRUMS;
+			}
+			m_contexts.push_back(context);
+			return true;
+		}
+		bool end_array()
+		{
+			m_contexts.pop_back();
+			return true;
+		}
+		bool parse_error(std::size_t, std::string const&, nlohmann::detail::exception const&) { return false; }
+
+	private:
+		enum Context { ROOT, KIT, KIT_DRUMS, KIT_DRUM, PATTERNS, PATTERN, LANES, LANE, VELOCITY, HITS, HIT, SKIP };
+
+		Context top() const { return m_contexts.empty() ? SKIP : m_contexts.back(); }
+		JsonState::Pattern& pattern() { return m_state.patterns.back(); }
+		static int to_int(double value) { return int(std::clamp(value, double(std::numeric_limits<int>::min()), double(std::numeric_limits<int>::max()))); }
+
+		bool number(double value)
+		{
+			switch (top()) {
+			case VELOCITY: {
+				auto& p = pattern().pattern;
+				if (m_division < MAX_DIVISIONS) {
+					p.lanes[p.lane_count - 1].set_velocity(m_division++, to_int(value));
+				}
+				break;
+			}
+			case HIT: {
+				// [division, velocity]
+				auto& p = pattern().pattern;
+				if (m_hit_field == 0) {
+					m_division = to_int(value);
+				}
+				else if (m_hit_field == 1 && m_division >= 0 && m_division < MAX_DIVISIONS) {
+					p.lanes[p.lane_count - 1].set_velocity(m_division, to_int(value));
+				}
+				++m_hit_field;
+				break;
+			}
+			case LANE:
+				if (m_key == "note") {
+					auto& p = pattern().pattern;
+					p.set_lane_note(p.lane_count - 1, to_int(value));
+				}
+				break;
+			case PATTERN:
+				if (m_key == "beats") {
+					pattern().pattern.time_signature.beats = to_int(value);
+					pattern().has_time_signature = true;
+				}
+				else if (m_key == "beat_divisions") {
+					pattern().pattern.time_signature.beat_divisions = to_int(value);
+				}
+				else if (m_key == "index") {
+					pattern().index = to_int(value);
+				}
+				else if (m_key == "same_as") {
+					pattern().same_as = to_int(value);
+				}
+				break;
+			case KIT_DRUM:
+				if (m_key == "note") {
+					m_state.kit_notes.back() = to_int(value);
+				}
+				break;
+			case ROOT:
+				if (m_key == "version") {
+					m_state.version = to_int(value);
+				}
+				else if (m_key == "swing") {
+					m_state.swing = float(value);
+				}
+				else if (m_key == "current_pattern") {
+					m_state.current_pattern = to_int(value);
+				}
+				else if (m_key == "pattern_count") {
+					m_state.pattern_count = to_int(value);
+				}
+				else if (m_key == "beats") {
+					m_state.time_signature.beats = to_int(value);
+				}
+				else if (m_key == "beat_divisions") {
+					m_state.time_signature.beat_divisions = to_int(value);
+				}
+				break;
+			default:
+				break;
+			}
+			return true;
+		}
+
+		JsonState& m_state;
+		std::vector<Context> m_contexts;
+		std::string m_key;
+		int m_division = 0;
+		int m_hit_field = 0;
+	};
+
+	struct GeneralMidiDrum
+	{
+		int note;
+		std::string_view name;
+	};
+	constexpr GeneralMidiDrum GENERAL_MIDI_DRUMS[] = { {35, "Acoustic Bass Drum"}, {36, "Bass Drum"}, {37, "Side Stick"}, {38, "Acoustic Snare"}, {39, "Hand Clap"},
+	  {40, "Electric Snare"}, {41, "Low Floor Tom"}, {42, "Closed Hi Hat"}, {43, "High Floor Tom"}, {44, "Pedal Hi - Hat"}, {45, "Low Tom"},
+	  {46, "Open Hi - Hat"}, {47, "Low - Mid Tom"}, {48, "Hi - Mid Tom"}, {49, "Crash Cymbal 1"}, {50, "High Tom"}, {51, "Ride Cymbal 1"},
+	  {52, "Chinese Cymbal"}, {53, "Ride Bell"}, {54, "Tambourine"}, {55, "Splash Cymbal"}, {56, "Cowbell"}, {57, "Crash Cymbal 2"}, {58, "Vibraslap"},
+	  {59, "Ride Cymbal 2"}, {60, "Hi Bongo"}, {61, "Low Bongo"}, {62, "Mute Hi Conga"}, {63, "Open Hi Conga"}, {64, "Low Conga"}, {65, "Hi Timbale"},
+	  {66, "Low Timbale"}, {67, "Hi Agogo"}, {68, "Low Agogo"}, {69, "Cabasa"}, {70, "Maracas"}, {71, "Short Whistle"}, {72, "Long Whistle"},
+	  {73, "Short Guiro"}, {74, "Long Guiro"}, {75, "Claves"}, {76, "Hi Wood Block"}, {77, "Low Wood Block"}, {78, "Mute Cuica"}, {79, "Open Cuica"},
+	  {80, "Mute Triangle"}, {81, "Open Triangle"} };
+
+	void apply_delta(DrumPattern& pattern, PatternDelta const& delta, bool forward)
+	{
+		pattern.time_signature = forward ? delta.new_time_signature : delta.old_time_signature;
+		pattern.lane_count = forward ? delta.new_lane_count : delta.old_lane_count;
+		for (auto& n : delta.notes) {
+			pattern.lanes[n.lane].note = forward ? n.new_note : n.old_note;
+		}
+		pattern.update_note_lanes();
+		for (auto& c : delta.cells) {
+			pattern.lanes[c.lane].set_velocity(c.division, forward ? c.new_velocity : c.old_velocity);
+		}
+	}
+}
+
+std::string pattern_name(int pattern)
+{
+	std::string name;
+	for (++pattern; pattern > 0; pattern = (pattern - 1) / 26) {
+		name.insert(name.begin(), char('A' + (pattern - 1) % 26));
+	}
+	return name;
+}
+
+int pattern_from_name(std::string_view name)
+{
+	if (name.empty() || name.size() > 3) {
+		return -1;
+	}
+	int pattern = 0;
+	for (auto c : name) {
+		c = char(toupper((unsigned char)c));
+		if (c < 'A' || c > 'Z') {
+			return -1;
+		}
+		pattern = pattern * 26 + (c - 'A' + 1);
+	}
+	return pattern - 1;
+}
+
+std::uint64_t DrumPattern::hash() const
+{
+	// FNV-1a over the lanes in use, which is all that equal patterns must agree on
+	std::uint64_t h = 14695981039346656037ull;
+	auto add = [&h](std::uint64_t value) {
+		for (int byte = 0; byte < 8; ++byte, value >>= 8) {
+			h = (h ^ (value & 0xff)) * 1099511628211ull;
+		}
+		};
+	add(std::uint64_t(time_signature.beats) << 32 | std::uint32_t(time_signature.beat_divisions));
+	add(lane_count);
+	for (int lane = 0; lane < lane_count; ++lane) {
+		add(std::uint64_t(lanes[lane].note) << 32 | lanes[lane].hits);
+		for (int division = 0; division < MAX_DIVISIONS; division += 8) {
+			std::uint64_t eight = 0;
+			for (int i = 0; i < 8; ++i) {
+				eight |= std::uint64_t(lanes[lane].velocity[division + i]) << (i * 8);
+			}
+			add(eight);
+		}
+	}
+	return h;
+}
+
+DrumPattern const& PatternBank::operator[](int i) const
+{
+	static const DrumPattern empty;
+	auto pattern = slot(i);
+	return pattern ? *pattern : empty;
+}
+
+DrumPattern const* PatternBank::slot(int i) const
+{
+	if (!m_table || i < 0 || i / CHUNK_SIZE >= int(m_table->size())) {
+		return nullptr;
+	}
+	auto& chunk = (*m_table)[i / CHUNK_SIZE];
+	return chunk ? (*chunk)[i % CHUNK_SIZE].get() : nullptr;
+}
+
+PatternBank PatternBank::with(int i, DrumPattern const& pattern) const
+{
+	// An empty pattern goes back to being no pattern at all
+	return with(i, pattern == DrumPattern() ? nullptr : std::make_shared<const DrumPattern>(pattern));
+}
+
+PatternBank PatternBank::with(int i, std::shared_ptr<const DrumPattern> pattern) const
+{
+	PatternBank result = *this;
+	result.m_size = std::max(m_size, i + 1);
+	auto table = m_table ? std::make_shared<Table>(*m_table) : std::make_shared<Table>();
+	if (i / CHUNK_SIZE >= int(table->size())) {
+		table->resize(i / CHUNK_SIZE + 1);
+	}
+	auto& old_chunk = (*table)[i / CHUNK_SIZE];
+	auto chunk = old_chunk ? std::make_shared<Chunk>(*old_chunk) : std::make_shared<Chunk>();
+	(*chunk)[i % CHUNK_SIZE] = std::move(pattern);
+	old_chunk = std::move(chunk);
+	result.m_table = std::move(table);
+	return result;
+}
+
+PatternBank PatternBank::resized(int size) const
+{
+	PatternBank result = *this;
+	result.m_size = std::clamp(size, 1, MAX_PATTERNS);
+	if (result.m_size >= m_size || !m_table) {
 		return result;
 	}
-	double count_seq(const char* c) {
-		return count_seq_impl(c);
+	int chunks = (result.m_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	auto table = std::make_shared<Table>(m_table->begin(), m_table->begin() + std::min(chunks, int(m_table->size())));
+	if (int(table->size()) == chunks && result.m_size % CHUNK_SIZE != 0 && table->back()) {
+		auto chunk = std::make_shared<Chunk>(*table->back());
+		std::fill(chunk->begin() + result.m_size % CHUNK_SIZE, chunk->end(), nullptr);
+		table->back() = std::move(chunk);
+	}
+	result.m_table = std::move(table);
+	return result;
+}
+
+std::shared_ptr<const DrumPattern> PatternPool::intern(DrumPattern const& pattern)
+{
+	if (pattern == DrumPattern()) {
+		return nullptr;
+	}
+	if (m_entries.size() >= m_sweep_at) {
+		std::erase_if(m_entries, [](auto const& entry) { return entry.second.pattern.expired(); });
+		m_sweep_at = std::max<std::size_t>(64, m_entries.size() * 2);
+	}
+	auto hash = pattern.hash();
+	auto [first, last] = m_entries.equal_range(hash);
+	for (auto e = first; e != last; ++e) {
+		if (auto existing = e->second.pattern.lock(); existing && *existing == pattern) {
+			return existing;
+		}
 	}
+	auto shared = std::make_shared<const DrumPattern>(pattern);
+	m_entries.insert({ hash, Entry{ shared, {} } });
+	return shared;
+}
+
+PatternPool::Entry* PatternPool::find(DrumPattern const& pattern)
+{
+	// A live entry at the same address can only be this very pattern
+	auto [first, last] = m_entries.equal_range(pattern.hash());
+	for (auto e = first; e != last; ++e) {
+		if (auto existing = e->second.pattern.lock(); existing.get() == &pattern) {
+			return &e->second;
+		}
+	}
+	return nullptr;
+}
+
+std::shared_ptr<const DrumEvents> PatternPool::find_events(DrumPattern const& pattern)
+{
+	auto entry = find(pattern);
+	return entry ? entry->events.lock() : nullptr;
+}
+
+void PatternPool::set_events(DrumPattern const& pattern, std::shared_ptr<const DrumEvents> const& events)
+{
+	if (auto entry = find(pattern)) {
+		entry->events = events;
+	}
+}
+
+void PatternPool::clear_events()
+{
+	for (auto& entry : m_entries) {
+		entry.second.events.reset();
+	}
+}
+
+template <typename F>
+void DrumData::do_action(int pattern_id, F&& edit)
+{
+	begin_transaction();
+	m_transaction_touched.set(pattern_id);
+	auto pattern = m_patterns[pattern_id];
+	edit(pattern);
+	// Interning makes an edit that changes nothing leave the bank untouched
+	auto shared = m_pattern_pool.intern(pattern);
+	if (shared.get() != (m_patterns.used(pattern_id) ? &m_patterns[pattern_id] : nullptr)) {
+		m_patterns = m_patterns.with(pattern_id, std::move(shared));
+	}
+	commit_transaction();
 }
 
 DrumData::DrumData(DrumDataListener& listener)
 	: m_listener(listener),
 	m_midi_file_directory(juce::File::getSpecialLocation(juce::File::userDocumentsDirectory).getFullPathName().toStdString())
 {
-	load_kits();
-	m_current_pattern_sequence.push_back({ 0.f, 4.f, 0 });
+	// Nothing is compiled until a pattern is first played or exported
+	m_events_dirty.set();
+	publish();
 }
 
 void DrumData::add_drum(std::string name, int note)
 {
-	do_action(
-		[this, note]
-		{
-			m_patterns[m_current_pattern].lanes.emplace_back(m_patterns[m_current_pattern].time_signature.total_divisions());
-			m_patterns[m_current_pattern].lanes.back().note = note;
-		},
-		[this, pattern = m_current_pattern]
-		{
-			m_patterns[pattern].lanes.pop_back();
-		});
+	if (lane_count() >= MAX_LANES) {
+		return;
+	}
+	do_action(m_current_pattern, [note](DrumPattern& pattern) { pattern.add_lane(note); });
 }
 
 void DrumData::set_current_pattern(int pattern) 
 {
-	if (pattern < 0 || pattern >= m_patterns.size()) {
+	if (pattern < 0 || pattern >= m_patterns.size() || pattern == m_current_pattern) {
 		return;
 	}
 	m_current_pattern = pattern;
+	state_changed();
+	if (!m_play_sequence) {
+		publish();
+	}
 }
 
 void DrumData::set_pattern(int pattern_index, DrumPattern const& pattern)
@@ -148,15 +757,7 @@ void DrumData::set_pattern(int pattern_index, DrumPattern const& pattern)
 		return;
 	}
 
-	do_action(
-		[this, pattern_index, pattern] {
-			m_patterns[pattern_index] = pattern;
-			update_events();
-		},
-		[this, pattern_index, old_pattern = m_patterns[pattern_index]]
-		{ m_patterns[pattern_index] = old_pattern;
-			update_events();
-		});
+	do_action(pattern_index, [&pattern](DrumPattern& p) { p = pattern; });
 }
 
 void DrumData::set_lane_note(int lane, int note)
@@ -165,113 +766,73 @@ void DrumData::set_lane_note(int lane, int note)
 		return;
 	}
 
-	int pattern = m_current_pattern;
-	int old_note = m_patterns[pattern].lanes[lane].note;
-	do_action(
-		[this, pattern, lane, note] {
-			m_patterns[pattern].lanes[lane].note = note;
-			update_events();
-		},
-		[this, pattern, lane, old_note] {
-			m_patterns[pattern].lanes[lane].note = old_note;
-			update_events();
-		});
+	do_action(m_current_pattern, [lane, note](DrumPattern& pattern) { pattern.set_lane_note(lane, note); });
 }
 
 void DrumData::set_sequence_str(std::string const& sequence)
 {
-	m_sequence_str.clear();
-	m_sequence_length = 0;
-	m_sequence.clear();
-	for (auto c : sequence) {
-		if (isalpha(c)) {
-			c = char(toupper(c));
-			if (c - 'A' < m_patterns.size()) {
-				m_sequence_str.push_back(c);
-			}
-		}
-		else if (isdigit(c) || c == '(' || c == ')') {
-			m_sequence_str.push_back(c);
-		}
-	}
-	const char* c = m_sequence_str.c_str();
-	if (validate(c)) {
-		auto len = count_seq(c);
-		if (len < 10000) {
-			m_sequence_length = int(len);
-			c = m_sequence_str.c_str();
-			m_sequence = parse_seq(c, m_patterns);
-		}
-	}
+	m_sequence = compile_sequence(sequence, m_patterns, m_sequence_str, m_sequence_error);
+	state_changed();
+	publish();
 }
 
 void DrumData::update_sequence()
 {
-	m_sequence = parse_seq(m_sequence_str.c_str(), m_patterns);
+	// The cleaned string compiles to itself, so it can be passed back in
+	auto text = m_sequence_str;
+	m_sequence = compile_sequence(text, m_patterns, m_sequence_str, m_sequence_error);
+}
+
+void DrumData::add_pattern_page()
+{
+	if (m_patterns.size() + PATTERN_PAGE_SIZE <= MAX_PATTERNS) {
+		m_patterns = m_patterns.resized(m_patterns.size() + PATTERN_PAGE_SIZE);
+		state_changed();
+	}
 }
 
 void DrumData::play_sequence(bool ps)
 {
 	m_play_sequence = ps;
+	state_changed();
+	publish();
 }
 
 void DrumData::set_time_signature(int new_beats, int new_beat_divisions)
 {
-	if (new_beats <= 0 || new_beat_divisions <= 0)
+	if (!TimeSignature{ new_beats, new_beat_divisions }.valid())
 	{
 		return;
 	}
-	int old_beats = beats();
-	int old_beat_divisions = beat_divisions();
-	do_action(
-		[this, new_beats, new_beat_divisions, pattern_id = m_current_pattern] {
-			auto& pattern = m_patterns[pattern_id];
-			pattern.time_signature.beats = new_beats;
-			pattern.time_signature.beat_divisions = new_beat_divisions;
-			for (auto& lane : pattern.lanes)
-			{
-				lane.velocity.resize(new_beats * new_beat_divisions);
-			}
-			update_sequence();
-			update_events();
-		},
-		[this, old_beats, old_beat_divisions, old_pattern = m_patterns[m_current_pattern], pattern_id = m_current_pattern] {
-			m_patterns[pattern_id] = old_pattern;
-			update_sequence();
-			update_events();
+	do_action(m_current_pattern, [new_beats, new_beat_divisions](DrumPattern& pattern) {
+		pattern.time_signature.beats = new_beats;
+		pattern.time_signature.beat_divisions = new_beat_divisions;
+		for (int lane = 0; lane < pattern.lane_count; ++lane)
+		{
+			pattern.lanes[lane].truncate(new_beats * new_beat_divisions);
+		}
 		});
 }
 
-bool DrumData::set_hit_at_time(double beat_time, int note, int velocity)
+bool DrumData::set_hit_at_time(std::int64_t tick, int note, int velocity)
 {
 	auto& pattern = m_patterns[m_current_pattern];
-	int division = static_cast<int>(std::round(beat_time * pattern.time_signature.beat_divisions)) % pattern.time_signature.total_divisions();
-	for (int lane = 0; lane < pattern.lanes.size(); ++lane) {
-		if (pattern.lanes[lane].note == note) {
-			int old_velocity = pattern.lanes[lane].velocity[division];
-			do_action(
-				[this, lane, division, velocity, pattern_id = m_current_pattern] {
-					m_patterns[pattern_id].lanes[lane].velocity[division] = velocity;
-					update_events(pattern_id);
-				},
-				[this, lane, division, old_velocity, pattern_id = m_current_pattern] {
-					m_patterns[pattern_id].lanes[lane].velocity[division] = old_velocity;
-					update_events(pattern_id);
-				});
-			return false;
-		}
+	auto division_ticks = pattern.time_signature.division_ticks();
+	auto total_divisions = pattern.time_signature.total_divisions();
+	int division = int(floor_div(tick + division_ticks / 2, division_ticks) % total_divisions);
+	if (division < 0) {
+		division += total_divisions;
+	}
+	int lane = pattern.lane_for_note(note);
+	if (lane >= 0) {
+		do_action(m_current_pattern, [lane, division, velocity](DrumPattern& p) {
+			p.lanes[lane].set_velocity(division, velocity);
+			});
+		return false;
 	}
-	if (pattern.lanes.size() < MAX_LANES) {
-		do_action(
-			[this, note, division, velocity, pattern_id = m_current_pattern] {
-				m_patterns[pattern_id].lanes.emplace_back(m_patterns[pattern_id].time_signature.total_divisions());
-				m_patterns[pattern_id].lanes.back().note = note;
-				m_patterns[pattern_id].lanes.back().velocity[division] = velocity;
-				update_events(pattern_id);
-			},
-			[this, pattern_id = m_current_pattern] {
-				m_patterns[pattern_id].lanes.pop_back();
-				update_events(pattern_id);
+	if (pattern.lane_count < MAX_LANES) {
+		do_action(m_current_pattern, [note, division, velocity](DrumPattern& p) {
+			p.add_lane(note).set_velocity(division, velocity);
 			});
 	}
 	return true;
@@ -280,62 +841,68 @@ bool DrumData::set_hit_at_time(double beat_time, int note, int velocity)
 void DrumData::set_swing(float swing)
 {
 	m_swing = swing;
-	update_events();
+	m_pattern_pool.clear_events();
+	m_events_dirty.set();
+	state_changed();
+	publish();
 }
 
 int DrumData::lane_count() const
 {
-	return (int)m_patterns[m_current_pattern].lanes.size();
+	return m_patterns[m_current_pattern].lane_count;
 }
 
 std::vector<std::string> DrumData::get_kit_names() const
 {
 	std::vector<std::string> kit_names;
-	for (auto& kit : m_kits) {
-		kit_names.push_back(kit.name);
+	for (int i = 0; i < m_kits->size(); ++i) {
+		kit_names.push_back((*m_kits)[i].name);
 	}
 	return kit_names;
 }
 
 std::vector<DrumInfo> const &DrumData::get_current_kit_drums() const
 {
-	return m_kits[m_current_kit].drums;
+	return (*m_kits)[m_current_kit].drums;
 }
 
 std::string DrumData::get_drum_name(int note) const
 {
-	for (int i = 0; i < m_kits[m_current_kit].drums.size(); ++i) {
-		if (m_kits[m_current_kit].drums[i].note == note) {
-			return m_kits[m_current_kit].drums[i].name;
+	if (note >= 0 && note < NUM_NOTES) {
+		auto& kit = (*m_kits)[m_current_kit];
+		auto entry = kit.notes[note];
+		if (entry.flags & DrumKit::NOTE_IN_KIT) {
+			return kit.drums[entry.drum].name;
+		}
+		if (entry.flags & DrumKit::NOTE_IN_FALLBACK) {
+			return m_kits->fallback().drums[entry.drum].name + "*";
 		}
 	}
+	return std::format("{}", note);
+}
 
-	for (int i = 0; i < m_kits[0].drums.size(); ++i) {
-		if (m_kits[0].drums[i].note == note) {
-			return m_kits[0].drums[i].name + "*";
+void DrumData::update_dirty_events(Sequence const& sequence)
+{
+	auto dirty = m_events_dirty & sequence.patterns();
+	for (int pattern = 0; pattern < m_patterns.size(); ++pattern) {
+		if (dirty[pattern]) {
+			update_events(pattern);
 		}
 	}
-	return std::format("{}", note);
 }
 
-void DrumData::update_events()
+DrumEvents const& DrumData::events(int pattern)
 {
-	for (int i = 0; i < m_patterns.size(); ++i) {
-		update_events(i);
+	if (m_events_dirty[pattern]) {
+		update_events(pattern);
 	}
+	return *m_pattern_events[pattern];
 }
 
 void DrumData::set_hit(int lane, int division, int velocity)
 {
-	int old_velocity = m_patterns[m_current_pattern].lanes[lane].velocity[division];
-	do_action(
-		[this, lane, division, velocity, pattern = m_current_pattern] {
-			m_patterns[pattern].lanes[lane].velocity[division] = velocity;
-			update_events(pattern);
-		},
-		[this, lane, division, old_velocity, pattern = m_current_pattern] {
-			m_patterns[pattern].lanes[lane].velocity[division] = old_velocity;
-			update_events(pattern);
+	do_action(m_current_pattern, [lane, division, velocity](DrumPattern& pattern) {
+		pattern.lanes[lane].set_velocity(division, velocity);
 		});
 }
 
@@ -346,198 +913,568 @@ int DrumData::get_hit(int lane, int division) const
 
 void DrumData::clear_hits()
 {
-	do_action(
-		[this, pattern = m_current_pattern] {
-			for (auto& lane : m_patterns[pattern].lanes) {
-				for (auto& v : lane.velocity) {
-					v = 0;
-				}
-			}
-			update_events(pattern);
-		},
-		[this, pattern_id = m_current_pattern, pattern = m_patterns[m_current_pattern]] {
-			m_patterns[pattern_id] = pattern;
-			update_events(pattern_id);
+	do_action(m_current_pattern, [](DrumPattern& pattern) {
+		for (auto& lane : pattern.lanes) {
+			lane.velocity = {};
+			lane.hits = 0;
+		}
 		});
 }
 
 void DrumData::clear_all()
 {
-	do_action(
-		[this, pattern = m_current_pattern] {
-			m_patterns[pattern].lanes.clear();
-			update_events(pattern);
-		},
-		[this, pattern_id = m_current_pattern, pattern = m_patterns[m_current_pattern]] {
-			m_patterns[pattern_id] = pattern;
-			update_events(pattern_id);
-		});
+	do_action(m_current_pattern, [](DrumPattern& pattern) { pattern.clear_lanes(); });
 }
 
-std::vector<SequenceItem> const& DrumData::get_playing_sequence() const
+std::int64_t PlaybackSnapshot::get_wrapped_tick(std::int64_t tick) const
 {
-	if (m_play_sequence) {
-		return m_sequence;
+	if (length_ticks <= 0) {
+		return 0;
 	}
-	m_current_pattern_sequence[0].pattern = m_current_pattern;
-	m_current_pattern_sequence[0].end_beat = m_patterns[m_current_pattern].time_signature.beats;
-	return m_current_pattern_sequence;
+	return tick - floor_div(tick, length_ticks) * length_ticks;
 }
 
-double DrumData::get_wrapped_time(double time_beats) const
+int PlaybackSnapshot::get_pattern(std::int64_t tick) const
 {
-	auto const& sequence = get_playing_sequence();
-	if (sequence.size() == 0) {
-		return 0.;
+	if (sequence->empty()) {
+		return -1;
 	}
-	double sequence_length_beats = sequence.back().end_beat;
-	return fmod(time_beats, sequence_length_beats);
+	return sequence->locate(tick).pattern;
 }
 
-int DrumData::get_sequence_index(double time_beats) const
+void PlaybackSnapshot::seek(PlaybackCursor& cursor, std::int64_t tick) const
 {
-	if (!m_play_sequence) {
-		return 0;
+	cursor.generation = generation;
+	cursor.end_tick = tick;
+	cursor.item = sequence->locate(tick);
+	cursor.previous = sequence->locate(cursor.item.start_tick - 1);
+	auto offset = tick - cursor.item.start_tick;
+	cursor.event_index = first_event_at(*pattern_events[cursor.item.pattern], offset);
+	auto previous_length = cursor.previous.end_tick - cursor.previous.start_tick;
+	cursor.overhang_index = first_event_at(*pattern_events[cursor.previous.pattern], previous_length + offset);
+}
+
+void PlaybackSnapshot::next_item(PlaybackCursor& cursor) const
+{
+	cursor.previous = cursor.item;
+	cursor.item = sequence->locate(cursor.previous.end_tick);
+	cursor.event_index = 0;
+	auto previous_length = cursor.previous.end_tick - cursor.previous.start_tick;
+	cursor.overhang_index = first_event_at(*pattern_events[cursor.previous.pattern], previous_length);
+}
+
+Sequence Sequence::single(int pattern, std::int64_t length_ticks)
+{
+	Sequence sequence;
+	sequence.set_root(sequence.add_leaf(pattern, 1, length_ticks));
+	return sequence;
+}
+
+int Sequence::add_leaf(int pattern, std::int64_t repeat, std::int64_t length_ticks)
+{
+	if (repeat <= 0 || length_ticks <= 0) {
+		return -1;
 	}
-	if (m_sequence.size() == 0) {
-		return 0;
+	if (length_ticks > MAX_LENGTH_TICKS / repeat) {
+		m_valid = false;
+		return -1;
+	}
+	Node node;
+	node.pattern = pattern;
+	node.repeat = repeat;
+	node.length_ticks = length_ticks;
+	node.item_count = 1;
+	m_nodes.push_back(node);
+	m_patterns.set(pattern);
+	return int(m_nodes.size()) - 1;
+}
+
+int Sequence::add_group(std::span<const int> children, std::int64_t repeat)
+{
+	if (repeat <= 0 || children.empty()) {
+		return -1;
 	}
-	double time_wrap = get_wrapped_time(time_beats);
-	for (int seq_index = 0; seq_index < m_sequence.size(); ++seq_index) {
-		if (m_sequence[seq_index].end_beat >= time_wrap) {
-			return seq_index;
+	Node node;
+	node.repeat = repeat;
+	node.first_child = int(m_children.size());
+	node.child_count = int(children.size());
+	for (auto child : children) {
+		auto& c = m_nodes[child];
+		c.start_tick = node.length_ticks;
+		node.length_ticks += node_ticks(c);
+		node.item_count += c.item_count * c.repeat;
+		if (node.length_ticks > MAX_LENGTH_TICKS) {
+			m_valid = false;
+			return -1;
 		}
+		m_children.push_back(child);
 	}
-	return 0;
+	if (node.length_ticks > MAX_LENGTH_TICKS / repeat) {
+		m_valid = false;
+		return -1;
+	}
+	m_nodes.push_back(node);
+	return int(m_nodes.size()) - 1;
 }
 
+SequenceItem Sequence::locate(std::int64_t tick) const
+{
+	if (empty()) {
+		return {};
+	}
+	auto length = length_ticks();
+	auto start_tick = floor_div(tick, length) * length;
+	auto offset = tick - start_tick;
+	for (int node_id = m_root;;) {
+		auto& node = m_nodes[node_id];
+		auto pass = offset / node.length_ticks;
+		start_tick += pass * node.length_ticks;
+		offset -= pass * node.length_ticks;
+		if (node.pattern >= 0) {
+			return { start_tick, start_tick + node.length_ticks, node.pattern };
+		}
+		// The last child starting at or before offset
+		auto first = m_children.begin() + node.first_child;
+		auto child = std::upper_bound(first, first + node.child_count, offset,
+			[this](std::int64_t value, int id) { return value < m_nodes[id].start_tick; }) - 1;
+		start_tick += m_nodes[*child].start_tick;
+		offset -= m_nodes[*child].start_tick;
+		node_id = *child;
+	}
+}
 
-std::string DrumData::to_json() const
+PlaybackSnapshot const* DrumData::acquire_playback(PlaybackReader reader)
 {
-	using json = nlohmann::json;
-	json j;
-	j["version"] = 3;
-	j["midi_file_directory"] = m_midi_file_directory;
-	j["swing"] = m_swing;
-	j["patterns"] = json::array();
-	j["play_sequence"] = m_play_sequence;
-	j["current_pattern"] = m_current_pattern;
-	j["current_kit"] = m_kits[m_current_kit].name;
-	for (auto& pattern : m_patterns) {
-		json p;
-		p["beats"] = pattern.time_signature.beats;
-		p["beat_divisions"] = pattern.time_signature.beat_divisions;
-		p["lanes"] = json::array();
-		for (auto& lane : pattern.lanes) {
-			json l;
-			l["note"] = lane.note;
-			l["velocity"] = lane.velocity;
-			p["lanes"].push_back(l);
-		}
-		j["patterns"].push_back(p);
-	}
-	j["sequence"] = m_sequence_str;
-	return j.dump(3);
-}
-
-void DrumData::from_json(std::string const& json_string)
-{
-	using json = nlohmann::json;
-	auto j = json::parse(json_string);
-	int version = j.value("version", 0);
-	int beats = 4;
-	int beat_divisions = 4;
-	if (version < 3) {
-		beats = j["beats"];
-		beat_divisions = j["beat_divisions"];
-	}
-	auto user_doc_dir = juce::File::getSpecialLocation(juce::File::userDocumentsDirectory).getFullPathName().toStdString();
-	m_midi_file_directory = j.value("midi_file_directory", user_doc_dir);
-	m_swing = j["swing"];
-	DrumKit kit;
-	if (version < 1) {
-		kit.name = j["kit"]["name"];
-		kit.drums.clear(); for (auto& d : j["kit"]["drums"])
-		{
-			kit.drums.emplace_back(d["note"], d["name"]);
+	// Announce the snapshot we are about to use, then check it is still the published
+	// one. If it is, publish() is guaranteed to see it in m_in_use and leave it alone.
+	auto snapshot = m_published.load();
+	for (;;) {
+		m_in_use[reader].store(snapshot);
+		auto latest = m_published.load();
+		if (latest == snapshot) {
+			return snapshot;
 		}
+		snapshot = latest;
 	}
-	auto current_kit_name = j.value("current_kit", "General MIDI");
-	for (int i = 0; i < m_kits.size(); ++i) {
-		if (m_kits[i].name == current_kit_name) {
-			m_current_kit = i;
-			break;
+}
+
+
+void DrumData::publish()
+{
+	auto snapshot = std::make_unique<PlaybackSnapshot>();
+	snapshot->generation = ++m_generation;
+	if (m_play_sequence) {
+		snapshot->sequence = m_sequence;
+	}
+	else {
+		snapshot->sequence = std::make_shared<const Sequence>(Sequence::single(m_current_pattern, m_patterns[m_current_pattern].time_signature.total_ticks()));
+	}
+	snapshot->length_ticks = snapshot->sequence->length_ticks();
+	update_dirty_events(*snapshot->sequence);
+	// Only the patterns this snapshot plays, however big the bank is
+	auto& played = snapshot->sequence->patterns();
+	for (int pattern = 0; pattern < m_patterns.size(); ++pattern) {
+		if (played[pattern]) {
+			if (pattern >= int(snapshot->pattern_events.size())) {
+				snapshot->pattern_events.resize(pattern + 1);
+			}
+			snapshot->pattern_events[pattern] = m_pattern_events[pattern];
 		}
 	}
-	m_play_sequence = j.value("play_sequence", false);
-	m_current_pattern = j.value("current_pattern", 0);
-	int pattern_count = 0;
-	for (auto& p : j["patterns"]) {
-		DrumPattern pattern;
-		if (version < 3) {
-			pattern.time_signature.beats = beats;
-			pattern.time_signature.beat_divisions = beat_divisions;
+	m_published.store(snapshot.get());
+	m_snapshots.push_back(std::move(snapshot));
+
+	auto published = m_published.load();
+	std::array<const PlaybackSnapshot*, NUM_PLAYBACK_READERS> in_use;
+	for (int reader = 0; reader < NUM_PLAYBACK_READERS; ++reader) {
+		in_use[reader] = m_in_use[reader].load();
+	}
+	std::erase_if(m_snapshots, [published, &in_use](auto const& s) {
+		return s.get() != published && std::find(in_use.begin(), in_use.end(), s.get()) == in_use.end();
+		});
+}
+
+
+std::vector<std::uint8_t> const& DrumData::get_state()
+{
+	if (m_saved_generation != m_state_generation) {
+		m_saved_state = to_binary();
+		m_saved_generation = m_state_generation;
+	}
+	return m_saved_state;
+}
+
+std::vector<std::uint8_t> DrumData::to_binary() const
+{
+	StateWriter w;
+	w.bytes.reserve(256);
+	w.bytes.insert(w.bytes.end(), std::begin(STATE_MAGIC), std::end(STATE_MAGIC));
+	w.fixed(STATE_VERSION, 2);
+	w.fixed(0, 2);
+	w.fixed(0, 4); // Payload size and checksum, filled in at the end
+	w.fixed(0, 4);
+
+	w.fixed(std::bit_cast<std::uint32_t>(m_swing), 4);
+	w.fixed((m_play_sequence ? STATE_PLAY_SEQUENCE : 0) | (m_lookahead_render ? STATE_LOOKAHEAD_RENDER : 0), 1);
+	w.varint(m_current_pattern);
+	w.varint(m_patterns.size());
+	w.string(m_midi_file_directory);
+	w.string((*m_kits)[m_current_kit].name);
+	w.string(m_sequence_str);
+
+	int used = 0;
+	for (int i = 0; i < m_patterns.size(); ++i) {
+		used += m_patterns.used(i);
+	}
+	w.varint(used);
+	// Each used slot, then either 1 + the earlier slot it duplicates, or 0 and the
+	// pattern. Lanes store their hit bits and a velocity for each hit only.
+	std::unordered_map<DrumPattern const*, int> written;
+	for (int i = 0; i < m_patterns.size(); ++i) {
+		if (!m_patterns.used(i)) {
+			continue;
 		}
-		else {
-			pattern.time_signature.beats = p["beats"];
-			pattern.time_signature.beat_divisions = p["beat_divisions"];
+		auto& pattern = m_patterns[i];
+		w.varint(i);
+		if (auto [first, added] = written.try_emplace(&pattern, i); !added) {
+			w.varint(first->second + 1);
+			continue;
 		}
-		for (auto& l : p["lanes"]) {
-			DrumLane lane(0);
-			if (version < 1) {
-				lane.note = kit.drums[pattern.lanes.size()].note;
+		w.varint(0);
+		w.varint(pattern.time_signature.beats);
+		w.varint(pattern.time_signature.beat_divisions);
+		w.varint(pattern.lane_count);
+		for (int lane = 0; lane < pattern.lane_count; ++lane) {
+			auto& l = pattern.lanes[lane];
+			w.varint(std::uint32_t(l.note));
+			w.varint(l.hits);
+			for (auto hits = l.hits; hits != 0; hits &= hits - 1) {
+				w.bytes.push_back(l.velocity[std::countr_zero(hits)]);
 			}
-			else {
-				lane.note = l["note"];
+		}
+	}
+
+	auto payload_size = std::uint32_t(w.bytes.size() - STATE_HEADER_SIZE);
+	auto checksum = crc32(w.bytes.data() + STATE_HEADER_SIZE, payload_size);
+	for (int i = 0; i < 4; ++i) {
+		w.bytes[8 + i] = std::uint8_t(payload_size >> (i * 8));
+		w.bytes[12 + i] = std::uint8_t(checksum >> (i * 8));
+	}
+	return w.bytes;
+}
+
+bool DrumData::is_binary_state(void const* data, std::size_t size)
+{
+	return size >= STATE_HEADER_SIZE && std::equal(std::begin(STATE_MAGIC), std::end(STATE_MAGIC), static_cast<const char*>(data));
+}
+
+bool DrumData::from_binary(void const* data, std::size_t size)
+{
+	if (!is_binary_state(data, size)) {
+		return false;
+	}
+	auto bytes = static_cast<std::uint8_t const*>(data);
+	StateReader header{ bytes + 4, bytes + STATE_HEADER_SIZE };
+	auto version = header.fixed(2);
+	header.fixed(2);
+	auto payload_size = header.fixed(4);
+	auto checksum = header.fixed(4);
+	if (version > STATE_VERSION || payload_size != size - STATE_HEADER_SIZE
+		|| checksum != crc32(bytes + STATE_HEADER_SIZE, std::size_t(payload_size))) {
+		return false;
+	}
+
+	// Everything is read into locals first, so a bad state changes nothing
+	StateReader r{ bytes + STATE_HEADER_SIZE, bytes + size };
+	auto swing = std::bit_cast<float>(std::uint32_t(r.fixed(4)));
+	if (std::isnan(swing)) {
+		return false;
+	}
+	auto flags = r.fixed(1);
+	int current_pattern = r.integer(MAX_PATTERNS - 1);
+	int pattern_count = r.integer(MAX_PATTERNS);
+	auto midi_file_directory = r.string();
+	auto current_kit_name = r.string();
+	auto sequence = r.string();
+	int used = r.integer(MAX_PATTERNS);
+	auto patterns = PatternBank().resized(pattern_count);
+	for (int p = 0; p < used && r.ok; ++p) {
+		int index = r.integer(MAX_PATTERNS - 1);
+		int same_as = r.integer(MAX_PATTERNS);
+		if (same_as > 0) {
+			patterns = patterns.with(index, m_pattern_pool.intern(patterns[same_as - 1]));
+			continue;
+		}
+		DrumPattern pattern;
+		pattern.time_signature.beats = r.integer(std::numeric_limits<int>::max());
+		pattern.time_signature.beat_divisions = r.integer(std::numeric_limits<int>::max());
+		if (!pattern.time_signature.valid()) {
+			return false;
+		}
+		int lane_count = r.integer(MAX_LANES);
+		for (int lane = 0; lane < lane_count; ++lane) {
+			auto& l = pattern.add_lane(int(std::uint32_t(r.varint())));
+			auto hits = r.varint();
+			// Hits past the last division would play outside the pattern, or write outside the lane
+			if (hits >> pattern.time_signature.total_divisions()) {
+				return false;
 			}
+			for (; hits != 0; hits &= hits - 1) {
+				l.set_velocity(std::countr_zero(hits), int(r.fixed(1)));
+			}
+		}
+		patterns = patterns.with(index, m_pattern_pool.intern(pattern));
+	}
+	if (!r.ok || r.c != r.end) {
+		return false;
+	}
+
+	// Swing outside [0, 1] would move hits out of their division
+	m_swing = std::clamp(swing, 0.f, 1.f);
+	m_play_sequence = flags & STATE_PLAY_SEQUENCE;
+	m_lookahead_render = flags & STATE_LOOKAHEAD_RENDER;
+	m_midi_file_directory = midi_file_directory;
+	if (int kit = m_kits->find(current_kit_name); kit >= 0) {
+		m_current_kit = kit;
+	}
+	m_patterns = patterns;
+	clear_undo();
+	m_current_pattern = current_pattern < m_patterns.size() ? current_pattern : 0;
+	m_pattern_pool.clear_events();
+	m_events_dirty.set();
+	set_sequence_str(sequence);
+	return true;
+}
+
+bool DrumData::from_json(std::string const& json_string)
+{
+	JsonState state;
+	JsonStateReader reader(state);
+	if (!nlohmann::json::sax_parse(json_string, &reader)) {
+		return false;
+	}
 
-			for (auto v : l["velocity"]) {
-				lane.velocity.push_back(v);
+	auto patterns = PatternBank().resized(state.pattern_count);
+	// Older states list every slot in order, newer ones only the used slots
+	int pattern_index = 0;
+	for (auto& p : state.patterns) {
+		pattern_index = p.index >= 0 ? p.index : pattern_index;
+		if (pattern_index >= MAX_PATTERNS) {
+			break;
+		}
+		if (p.same_as >= 0) {
+			patterns = patterns.with(pattern_index, m_pattern_pool.intern(patterns[std::min(p.same_as, MAX_PATTERNS - 1)]));
+			++pattern_index;
+			continue;
+		}
+		auto& pattern = p.pattern;
+		if (state.version < 3 || !p.has_time_signature) {
+			pattern.time_signature = state.time_signature;
+		}
+		// Checked before anything is applied, as these would divide by zero later
+		if (!pattern.time_signature.valid()) {
+			return false;
+		}
+		for (int lane = 0; lane < pattern.lane_count; ++lane) {
+			pattern.lanes[lane].truncate(pattern.time_signature.total_divisions());
+		}
+		if (state.version < 1) {
+			// Lanes followed the order of the kit saved with them
+			for (int lane = 0; lane < pattern.lane_count && lane < int(state.kit_notes.size()); ++lane) {
+				pattern.set_lane_note(lane, state.kit_notes[lane]);
 			}
-			pattern.lanes.push_back(lane);
 		}
-		m_patterns[pattern_count] = pattern;
-		update_events(pattern_count);
-		++pattern_count;
+		patterns = patterns.with(pattern_index, m_pattern_pool.intern(pattern));
+		++pattern_index;
 	}
-	set_sequence_str(j.value("sequence", ""));
+
+	m_midi_file_directory = state.midi_file_directory.value_or(
+		juce::File::getSpecialLocation(juce::File::userDocumentsDirectory).getFullPathName().toStdString());
+	m_swing = std::clamp(state.swing, 0.f, 1.f);
+	m_lookahead_render = state.lookahead_render;
+	if (int kit = m_kits->find(state.current_kit); kit >= 0) {
+		m_current_kit = kit;
+	}
+	m_play_sequence = state.play_sequence;
+	m_patterns = patterns;
+	clear_undo();
+	m_current_pattern = state.current_pattern >= 0 && state.current_pattern < m_patterns.size() ? state.current_pattern : 0;
+	// All patterns compile once, when the sequence below is published
+	m_pattern_pool.clear_events();
+	m_events_dirty.set();
+	set_sequence_str(state.sequence);
+	return true;
 }
 
 void DrumData::update_events(int pattern_id)
 {
+	if (pattern_id >= int(m_pattern_events.size())) {
+		m_pattern_events.resize(pattern_id + 1);
+	}
+	m_events_dirty.reset(pattern_id);
 	auto& pattern = m_patterns[pattern_id];
-	pattern.m_events.clear();
-	double beat_from_division = 1. / pattern.time_signature.beat_divisions;
-	double swing_adjust1 = (0.5 - m_swing) * 2. * beat_from_division;
-	double swing_adjust2 = -swing_adjust1;
+	// Identical patterns are one interned object, so they share their events too
+	if (auto shared = m_pattern_pool.find_events(pattern)) {
+		m_pattern_events[pattern_id] = std::move(shared);
+		return;
+	}
+	auto events = std::make_shared<DrumEvents>();
+	int division_ticks = pattern.time_signature.division_ticks();
+	int note_length_ticks = division_ticks * 9 / 10;
+	auto swing_adjust1 = static_cast<int>(std::lround((0.5 - m_swing) * 2. * division_ticks));
+	auto swing_adjust2 = -swing_adjust1;
 	auto& lanes = pattern.lanes;
-	for (int division = 0; division < pattern.time_signature.total_divisions(); ++division) {
-		for (int lane = 0; lane < lanes.size(); ++lane) {
-			if (lanes[lane].velocity[division] > 0) {
+	std::uint32_t any_hits = 0;
+	for (int lane = 0; lane < pattern.lane_count; ++lane) {
+		any_hits |= lanes[lane].hits;
+	}
+	if (pattern.time_signature.total_divisions() < 32) {
+		any_hits &= (1u << pattern.time_signature.total_divisions()) - 1;
+	}
+	// Only visit divisions that have a hit in some lane
+	for (; any_hits != 0; any_hits &= any_hits - 1) {
+		int division = std::countr_zero(any_hits);
+		for (int lane = 0; lane < pattern.lane_count; ++lane) {
+			if (lanes[lane].hits & (1u << division)) {
 				DrumEvent e;
-				e.beat_time = beat_from_division * division;
+				e.tick = std::int64_t(division) * division_ticks;
 				if (division % 4 == 1) {
-					e.beat_time += swing_adjust2;
+					e.tick += swing_adjust2;
 				}
 				if (division % 4 == 3) {
-					e.beat_time += swing_adjust1;
+					e.tick += swing_adjust1;
 				}
 				e.note = lanes[lane].note;
 				e.velocity = lanes[lane].velocity[division];
-				pattern.m_events.push_back(e);
+				events->push_back(e);
 				e.velocity = 0;
-				e.beat_time += .9 / pattern.time_signature.beat_divisions;
-				pattern.m_events.push_back(e);
+				e.tick += note_length_ticks;
+				events->push_back(e);
 			}
 		}
 	}
+	std::stable_sort(events->begin(), events->end(),
+		[](DrumEvent const& a, DrumEvent const& b) { return a.tick < b.tick; });
+	m_pattern_pool.set_events(pattern, events);
+	m_pattern_events[pattern_id] = std::move(events);
 }
 
-void DrumData::do_action(std::function<void()> do_action, std::function<void()> undo_action)
+void DrumData::begin_transaction(int merge_id)
 {
-	m_undo_stack.push_back({ do_action, undo_action });
-	do_action();
+	if (m_transaction_depth++ == 0) {
+		m_transaction_merge_id = merge_id;
+		m_transaction_before = m_patterns;
+		m_transaction_touched.reset();
+	}
+}
+
+void DrumData::commit_transaction()
+{
+	if (m_transaction_depth == 0 || --m_transaction_depth > 0) {
+		return;
+	}
+	auto before = std::move(m_transaction_before);
+	m_transaction_before = PatternBank();
+	int pattern_count = std::max(before.size(), m_patterns.size());
+	std::bitset<MAX_PATTERNS> changed;
+	for (int pattern_id = 0; pattern_id < pattern_count; ++pattern_id) {
+		if (m_transaction_touched[pattern_id] && !m_patterns.shares(pattern_id, before) && !(before[pattern_id] == m_patterns[pattern_id])) {
+			changed.set(pattern_id);
+			if (!(before[pattern_id].time_signature == m_patterns[pattern_id].time_signature)) {
+				update_sequence();
+			}
+			mark_dirty(pattern_id);
+		}
+	}
+	if (changed.none()) {
+		return;
+	}
+	state_changed();
+
+	UndoRecord record;
+	record.merge_id = m_transaction_merge_id;
+	if (record.merge_id != 0 && !m_undo_stack.empty() && m_undo_stack.back().merge_id == record.merge_id) {
+		// Rewind each pattern to before the earlier step so one delta covers both
+		record = std::move(m_undo_stack.back());
+		m_undo_bytes -= record.bytes();
+		m_undo_stack.pop_back();
+		for (int pattern_id = 0; pattern_id < pattern_count; ++pattern_id) {
+			auto earlier = std::find_if(record.deltas.begin(), record.deltas.end(),
+				[pattern_id](auto const& delta) { return delta.pattern == pattern_id; });
+			if (changed[pattern_id] && earlier != record.deltas.end()) {
+				auto rewound = before[pattern_id];
+				apply_delta(rewound, *earlier, false);
+				before = before.with(pattern_id, rewound);
+				record.deltas.erase(earlier);
+			}
+		}
+	}
+	for (int pattern_id = 0; pattern_id < pattern_count; ++pattern_id) {
+		if (changed[pattern_id]) {
+			auto delta = make_delta(pattern_id, before[pattern_id], m_patterns[pattern_id]);
+			if (!delta.empty()) {
+				record.deltas.push_back(std::move(delta));
+			}
+		}
+	}
+	if (!record.deltas.empty()) {
+		record.deltas.shrink_to_fit();
+		push_undo(std::move(record));
+	}
+	publish();
+}
+
+void DrumData::push_undo(UndoRecord record)
+{
+	for (auto& redo : m_redo_stack) {
+		m_undo_bytes -= redo.bytes();
+	}
 	m_redo_stack.clear();
+	m_undo_bytes += record.bytes();
+	m_undo_stack.push_back(std::move(record));
+	trim_undo();
+}
+
+void DrumData::trim_undo()
+{
+	while (!m_undo_stack.empty() && m_undo_bytes > m_undo_budget) {
+		m_undo_bytes -= m_undo_stack.front().bytes();
+		m_undo_stack.pop_front();
+	}
+}
+
+void DrumData::clear_undo()
+{
+	m_undo_stack.clear();
+	m_redo_stack.clear();
+	m_undo_bytes = 0;
+}
+
+void DrumData::set_undo_budget(std::size_t bytes)
+{
+	m_undo_budget = bytes;
+	trim_undo();
+}
+
+void DrumData::apply_record(UndoRecord const& record, bool forward)
+{
+	auto apply = [this, forward](PatternDelta const& delta) {
+		auto pattern = m_patterns[delta.pattern];
+		auto old_time_signature = pattern.time_signature;
+		apply_delta(pattern, delta, forward);
+		m_patterns = m_patterns.with(delta.pattern, m_pattern_pool.intern(pattern));
+		state_changed();
+		if (!(pattern.time_signature == old_time_signature)) {
+			update_sequence();
+		}
+		mark_dirty(delta.pattern);
+		};
+	if (forward) {
+		std::for_each(record.deltas.begin(), record.deltas.end(), apply);
+	}
+	else {
+		std::for_each(record.deltas.rbegin(), record.deltas.rend(), apply);
+	}
 }
 
 void DrumData::undo()
@@ -545,10 +1482,10 @@ void DrumData::undo()
 	if (m_undo_stack.empty()) {
 		return;
 	}
-	auto action = m_undo_stack.back();
+	apply_record(m_undo_stack.back(), false);
+	m_redo_stack.push_back(std::move(m_undo_stack.back()));
 	m_undo_stack.pop_back();
-	action.undo_action();
-	m_redo_stack.push_back(action);
+	publish();
 }
 
 void DrumData::redo()
@@ -556,44 +1493,63 @@ void DrumData::redo()
 	if (m_redo_stack.empty()) {
 		return;
 	}
-	auto action = m_redo_stack.back();
+	apply_record(m_redo_stack.back(), true);
+	m_undo_stack.push_back(std::move(m_redo_stack.back()));
 	m_redo_stack.pop_back();
-	action.do_action();
-	m_undo_stack.push_back(action);
+	publish();
 }
 
-void DrumData::load_kits()
+KitLibrary::KitLibrary()
 {
 	DrumKit fallback;
 	fallback.name = "General MIDI";
-	fallback.drums = std::vector<DrumInfo>{ {35, "Acoustic Bass Drum"}, {36, "Bass Drum"}, {37, "Side Stick"}, {38, "Acoustic Snare"}, {39, "Hand Clap"},
-	  {40, "Electric Snare"}, {41, "Low Floor Tom"}, {42, "Closed Hi Hat"}, {43, "High Floor Tom"}, {44, "Pedal Hi - Hat"}, {45, "Low Tom"},
-	  {46, "Open Hi - Hat"}, {47, "Low - Mid Tom"}, {48, "Hi - Mid Tom"}, {49, "Crash Cymbal 1"}, {50, "High Tom"}, {51, "Ride Cymbal 1"},
-	  {52, "Chinese Cymbal"}, {53, "Ride Bell"}, {54, "Tambourine"}, {55, "Splash Cymbal"}, {56, "Cowbell"}, {57, "Crash Cymbal 2"}, {58, "Vibraslap"},
-	  {59, "Ride Cymbal 2"}, {60, "Hi Bongo"}, {61, "Low Bongo"}, {62, "Mute Hi Conga"}, {63, "Open Hi Conga"}, {64, "Low Conga"}, {65, "Hi Timbale"},
-	  {66, "Low Timbale"}, {67, "Hi Agogo"}, {68, "Low Agogo"}, {69, "Cabasa"}, {70, "Maracas"}, {71, "Short Whistle"}, {72, "Long Whistle"},
-	  {73, "Short Guiro"}, {74, "Long Guiro"}, {75, "Claves"}, {76, "Hi Wood Block"}, {77, "Low Wood Block"}, {78, "Mute Cuica"}, {79, "Open Cuica"},
-	  {80, "Mute Triangle"}, {81, "Open Triangle"} };
-
-	m_kits.push_back(fallback);
+	for (auto& drum : GENERAL_MIDI_DRUMS) {
+		fallback.drums.push_back({ drum.note, std::string(drum.name) });
+	}
+	m_kits.push_back(std::move(fallback));
 
 	juce::File appDirectory = juce::File::getSpecialLocation(juce::File::currentApplicationFile);
 	appDirectory = appDirectory.getParentDirectory();
 	juce::File kitFile = appDirectory.getChildFile("DrumKits.json");
 
 	std::ifstream in(kitFile.getFullPathName().getCharPointer());
-	if (!in.is_open()) {
-		return;
-	}
-	nlohmann::json j;
-	in >> j;
-	for (auto& k : j) {
-		DrumKit kit;
-		kit.name = k["name"];
-		for (auto& d : k["drums"]) {
-			kit.drums.emplace_back(d["note"], d["name"]);
+	if (in.is_open()) {
+		nlohmann::json j;
+		in >> j;
+		for (auto& k : j) {
+			DrumKit kit;
+			kit.name = k["name"];
+			for (auto& d : k["drums"]) {
+				kit.drums.emplace_back(d["note"], d["name"]);
+			}
+			m_kits.push_back(kit);
 		}
-		m_kits.push_back(kit);
 	}
+	for (auto& kit : m_kits) {
+		build_note_table(kit, m_kits[0]);
+	}
+}
+
+std::shared_ptr<const KitLibrary> KitLibrary::get()
+{
+	// Held weakly, so the library goes when the last instance does
+	static std::mutex mutex;
+	static std::weak_ptr<const KitLibrary> shared;
+	std::lock_guard lock(mutex);
+	auto library = shared.lock();
+	if (!library) {
+		library.reset(new KitLibrary);
+		shared = library;
+	}
+	return library;
+}
 
+int KitLibrary::find(std::string const& name) const
+{
+	for (int i = 0; i < size(); ++i) {
+		if (m_kits[i].name == name) {
+			return i;
+		}
+	}
+	return -1;
 }
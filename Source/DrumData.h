@@ -6,9 +6,35 @@
 #include <memory>
 #include <string>
 #include <fstream>
+#include <atomic>
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <limits>
+#include <array>
+#include <bit>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <optional>
+#include <mutex>
 
 const int MAX_LANES = 12;
 const int MAX_DIVISIONS = 32;
+const int TICKS_PER_BEAT = 3840;
+// Hosts round each block's position independently, so consecutive blocks can be a
+// couple of ticks apart either way. A block starting this close to where the last
+// one ended is treated as continuous playback.
+const int CONTINUITY_TICKS = 4;
+// Patterns are shown and added a page at a time, up to MAX_PATTERNS
+const int PATTERN_PAGE_SIZE = 16;
+const int MAX_PATTERNS = 1024;
+const int NUM_NOTES = 128;
+
+inline std::int64_t beats_to_ticks(double beats) { return std::llround(beats * TICKS_PER_BEAT); }
+inline double ticks_to_beats(std::int64_t ticks) { return double(ticks) / TICKS_PER_BEAT; }
+// Floor division, so negative host positions still land in the right loop pass.
+inline std::int64_t floor_div(std::int64_t a, std::int64_t b) { return a / b - (a % b != 0 && (a < 0) != (b < 0)); }
 
 struct DrumInfo
 {
@@ -20,18 +46,69 @@ struct DrumKit
 {
 	std::string name;
 	std::vector<DrumInfo> drums;
+
+	// For every MIDI note, the drum that names it: from this kit when it has one,
+	// otherwise from the General MIDI fallback. Filled in by KitLibrary.
+	enum NoteFlags : std::uint8_t { NOTE_IN_KIT = 1, NOTE_IN_FALLBACK = 2 };
+	struct NoteEntry
+	{
+		std::uint16_t drum = 0;
+		std::uint8_t flags = 0;
+	};
+	std::array<NoteEntry, NUM_NOTES> notes{};
 };
 
+// Every kit known to the process: General MIDI first, then those in DrumKits.json
+// next to the plugin. It is loaded by the first instance that asks, shared by all
+// of them and never changed, so reading it needs no locking.
+class KitLibrary
+{
+public:
+	static std::shared_ptr<const KitLibrary> get();
+
+	int size() const { return int(m_kits.size()); }
+	DrumKit const& operator[](int i) const { return m_kits[i]; }
+	DrumKit const& fallback() const { return m_kits[0]; }
+	// The kit with this name, or -1
+	int find(std::string const& name) const;
+
+private:
+	KitLibrary();
+	std::vector<DrumKit> m_kits;
+};
+
+// A lane is stored inline: one byte of velocity per division plus a bitmask of the
+// divisions that have a hit. Write velocities through set_velocity so the two agree.
 struct DrumLane
 {
-	DrumLane(int divisions) : velocity(divisions) {}
 	int note = 0;
-    std::vector<int> velocity;
+	std::uint32_t hits = 0;
+	std::array<std::uint8_t, MAX_DIVISIONS> velocity{};
+
+	void set_velocity(int division, int v)
+	{
+		velocity[division] = std::uint8_t(std::clamp(v, 0, 127));
+		if (velocity[division] > 0) {
+			hits |= 1u << division;
+		}
+		else {
+			hits &= ~(1u << division);
+		}
+	}
+	// Clears every division from total_divisions on
+	void truncate(int total_divisions)
+	{
+		for (int division = total_divisions; division < MAX_DIVISIONS; ++division) {
+			set_velocity(division, 0);
+		}
+	}
+	bool operator==(DrumLane const&) const = default;
 };
+static_assert(MAX_DIVISIONS <= 32, "DrumLane::hits has one bit per division");
 
 struct DrumEvent
 {
-	double beat_time;
+	std::int64_t tick;
 	int note;
 	int velocity;
 };
@@ -41,13 +118,148 @@ struct TimeSignature
 	int beats = 4;
 	int beat_divisions = 4;
 	int total_divisions() const { return beats * beat_divisions; }
+	int total_ticks() const { return beats * TICKS_PER_BEAT; }
+	int division_ticks() const { return TICKS_PER_BEAT / beat_divisions; }
+	// Every division has a cell in the lane
+	bool valid() const
+	{
+		return beats > 0 && beat_divisions > 0 && beat_divisions <= MAX_DIVISIONS / beats;
+	}
+	bool operator==(TimeSignature const&) const = default;
 };
 
+// Compiled events are kept sorted by tick so playback can binary search
+// for the first event in a block.
+using DrumEvents = std::vector<DrumEvent>;
+
+// Fixed capacity, so a whole pattern copies and compares without allocating.
+// Lanes past lane_count are kept empty.
 struct DrumPattern
 {
 	TimeSignature time_signature;
-	std::vector<DrumLane> lanes;
-	std::vector<DrumEvent> m_events;
+	int lane_count = 0;
+	std::array<DrumLane, MAX_LANES> lanes{};
+
+	// First lane playing each MIDI note, or -1. Change lanes and notes through the
+	// methods below so this stays current.
+	std::array<std::int8_t, NUM_NOTES> note_lanes = no_note_lanes();
+
+	int lane_for_note(int note) const { return note >= 0 && note < NUM_NOTES ? note_lanes[note] : -1; }
+
+	// The caller checks lane_count < MAX_LANES first
+	DrumLane& add_lane(int note)
+	{
+		int index = lane_count++;
+		auto& lane = lanes[index];
+		lane = {};
+		lane.note = note;
+		if (lane_for_note(note) < 0 && note >= 0 && note < NUM_NOTES) {
+			note_lanes[note] = std::int8_t(index);
+		}
+		return lane;
+	}
+	void remove_last_lane()
+	{
+		int index = --lane_count;
+		if (lane_for_note(lanes[index].note) == index) {
+			note_lanes[lanes[index].note] = -1;
+		}
+		lanes[index] = {};
+	}
+	void clear_lanes()
+	{
+		lanes = {};
+		lane_count = 0;
+		note_lanes = no_note_lanes();
+	}
+	void set_lane_note(int lane, int note)
+	{
+		lanes[lane].note = note;
+		update_note_lanes();
+	}
+	// Equal patterns hash equally, wherever they sit in the bank
+	std::uint64_t hash() const;
+	void update_note_lanes()
+	{
+		note_lanes = no_note_lanes();
+		for (int lane = lane_count - 1; lane >= 0; --lane) {
+			auto note = lanes[lane].note;
+			if (note >= 0 && note < NUM_NOTES) {
+				note_lanes[note] = std::int8_t(lane);
+			}
+		}
+	}
+	bool operator==(DrumPattern const&) const = default;
+
+private:
+	static constexpr std::array<std::int8_t, NUM_NOTES> no_note_lanes()
+	{
+		std::array<std::int8_t, NUM_NOTES> none{};
+		none.fill(-1);
+		return none;
+	}
+};
+
+// Patterns are named like spreadsheet columns: A to Z, then AA, AB and so on
+std::string pattern_name(int pattern);
+// The pattern with this name, or -1 if it is not a name
+int pattern_from_name(std::string_view name);
+
+// Persistent, sparse set of patterns. Versions share every pattern they have in
+// common, so copying a bank (for undo, comparison or publishing) is one reference
+// count, and changing a pattern copies only that pattern and its chunk of pointers.
+// Empty slots hold no pattern at all, so a large bank costs only what it uses.
+class PatternBank
+{
+public:
+	PatternBank() = default;
+
+	// Empty slots read as a default pattern
+	DrumPattern const& operator[](int i) const;
+	int size() const { return m_size; }
+	bool used(int i) const { return slot(i) != nullptr; }
+	// A new version of the bank with pattern i replaced, growing it to hold i
+	PatternBank with(int i, DrumPattern const& pattern) const;
+	// As above, sharing the given pattern. Null empties the slot.
+	PatternBank with(int i, std::shared_ptr<const DrumPattern> pattern) const;
+	// A new version with room for size patterns. Shrinking drops the patterns past the end.
+	PatternBank resized(int size) const;
+	// True if both versions hold the very same pattern i, so it is unchanged
+	bool shares(int i, PatternBank const& other) const { return slot(i) == other.slot(i); }
+
+private:
+	static constexpr int CHUNK_SIZE = 16;
+	using Chunk = std::array<std::shared_ptr<const DrumPattern>, CHUNK_SIZE>;
+	using Table = std::vector<std::shared_ptr<const Chunk>>;
+	DrumPattern const* slot(int i) const;
+
+	std::shared_ptr<const Table> m_table;
+	int m_size = PATTERN_PAGE_SIZE;
+};
+
+// Interns patterns by content, so identical patterns in any slot, any version of
+// the bank or a loaded state are one object and compile to one event stream.
+// Entries hold weak references and are swept once most of them have expired.
+class PatternPool
+{
+public:
+	// The shared copy of pattern, or null for an empty pattern
+	std::shared_ptr<const DrumPattern> intern(DrumPattern const& pattern);
+	// Events already compiled for an interned pattern, if anyone still holds them
+	std::shared_ptr<const DrumEvents> find_events(DrumPattern const& pattern);
+	void set_events(DrumPattern const& pattern, std::shared_ptr<const DrumEvents> const& events);
+	// After a change that affects how every pattern compiles
+	void clear_events();
+
+private:
+	struct Entry
+	{
+		std::weak_ptr<const DrumPattern> pattern;
+		std::weak_ptr<const DrumEvents> events;
+	};
+	Entry* find(DrumPattern const& pattern);
+	std::unordered_multimap<std::uint64_t, Entry> m_entries;
+	std::size_t m_sweep_at = 64;
 };
 
 class DrumDataListener
@@ -56,19 +268,163 @@ public:
 	virtual void changed() = 0;
 };
 
-struct Action
+// One undoable edit, stored as the cells and lane headers it changed in one pattern
+struct PatternDelta
+{
+	struct Cell
+	{
+		std::uint8_t lane;
+		std::uint8_t division;
+		std::uint8_t old_velocity;
+		std::uint8_t new_velocity;
+	};
+	struct Note
+	{
+		std::uint8_t lane;
+		std::uint8_t old_note;
+		std::uint8_t new_note;
+	};
+
+	int pattern = 0;
+	TimeSignature old_time_signature;
+	TimeSignature new_time_signature;
+	int old_lane_count = 0;
+	int new_lane_count = 0;
+	std::vector<Note> notes;
+	std::vector<Cell> cells;
+
+	bool empty() const { return notes.empty() && cells.empty() && old_lane_count == new_lane_count && old_time_signature == new_time_signature; }
+	std::size_t bytes() const { return sizeof(PatternDelta) + notes.capacity() * sizeof(Note) + cells.capacity() * sizeof(Cell); }
+};
+
+// Everything one undo step reverts: a single edit or a whole transaction
+struct UndoRecord
 {
-	std::function<void()> do_action;
-	std::function<void()> undo_action;
+	int merge_id = 0;
+	std::vector<PatternDelta> deltas;
+
+	std::size_t bytes() const
+	{
+		std::size_t total = sizeof(UndoRecord) + (deltas.capacity() - deltas.size()) * sizeof(PatternDelta);
+		for (auto& delta : deltas) {
+			total += delta.bytes();
+		}
+		return total;
+	}
 };
 
+// One play of one pattern within the song
 struct SequenceItem
 {
-	double start_beat = 0.f;
-	double end_beat = 0.f;
+	std::int64_t start_tick = 0;
+	std::int64_t end_tick = 0;
 	int pattern = 0;
 };
 
+// Where a sequence string stopped making sense. position indexes the cleaned up
+// string that get_sequence_str() returns, and is -1 when the string compiled.
+struct SequenceError
+{
+	int position = -1;
+	std::string message;
+	explicit operator bool() const { return position >= 0; }
+};
+
+// A song kept as the tree of repeats it was written as, never expanded. Every node
+// knows the length of one pass through it and where it starts within its parent,
+// so finding the item at a tick walks down a single branch.
+class Sequence
+{
+public:
+	// Songs longer than this, in ticks, are rejected rather than risk overflow
+	static constexpr std::int64_t MAX_LENGTH_TICKS = std::int64_t(1) << 60;
+
+	static Sequence single(int pattern, std::int64_t length_ticks);
+
+	// Building happens bottom up: children are added before the group holding them.
+	// Each returns a node id, or -1 if the node plays for no time at all.
+	int add_leaf(int pattern, std::int64_t repeat, std::int64_t length_ticks);
+	int add_group(std::span<const int> children, std::int64_t repeat);
+	void set_root(int node) { m_root = node; }
+	bool valid() const { return m_valid; }
+
+	bool empty() const { return m_root < 0; }
+	std::int64_t length_ticks() const { return empty() ? 0 : node_ticks(m_nodes[m_root]); }
+	std::int64_t item_count() const { return empty() ? 0 : m_nodes[m_root].item_count * m_nodes[m_root].repeat; }
+	std::bitset<MAX_PATTERNS> const& patterns() const { return m_patterns; }
+
+	// The item playing at tick. Ticks outside the song wrap round.
+	SequenceItem locate(std::int64_t tick) const;
+	// Calls f(item) for every item of one pass through the song, in order
+	template <typename F>
+	void for_each_item(F&& f) const;
+
+private:
+	struct Node
+	{
+		int pattern = -1; // A leaf when >= 0, otherwise a group
+		std::int64_t repeat = 1;
+		std::int64_t length_ticks = 0; // One pass
+		std::int64_t item_count = 0; // Items in one pass
+		std::int64_t start_tick = 0; // Offset within one pass of the parent
+		int first_child = 0;
+		int child_count = 0;
+	};
+	static std::int64_t node_ticks(Node const& node) { return node.length_ticks * node.repeat; }
+	template <typename F>
+	void for_each_item(int node, std::int64_t start_tick, F& f) const;
+
+	std::vector<Node> m_nodes;
+	std::vector<int> m_children;
+	int m_root = -1;
+	bool m_valid = true;
+	std::bitset<MAX_PATTERNS> m_patterns;
+};
+
+// Where playback got to at the end of the previous block. When the next block
+// starts where this one ended the cursor just carries on, otherwise it seeks.
+// Events a pattern places past its own end play at the start of the next item,
+// so the cursor walks the previous item's overhang alongside the current item.
+struct PlaybackCursor
+{
+	std::uint64_t generation = 0;
+	std::int64_t end_tick = 0;
+	SequenceItem item;
+	SequenceItem previous;
+	std::size_t event_index = 0;
+	std::size_t overhang_index = 0;
+};
+
+// Immutable, compiled view of everything processBlock needs to generate MIDI.
+// DrumData builds a new one on the message thread after every edit and hands it
+// to the audio thread with an atomic pointer swap.
+struct PlaybackSnapshot
+{
+	std::uint64_t generation = 0;
+	std::shared_ptr<const Sequence> sequence;
+	// Compiled events of every pattern the sequence plays
+	std::vector<std::shared_ptr<const DrumEvents>> pattern_events;
+	std::int64_t length_ticks = 0;
+
+	std::int64_t get_wrapped_tick(std::int64_t tick) const;
+	int get_pattern(std::int64_t tick) const;
+	void seek(PlaybackCursor& cursor, std::int64_t tick) const;
+	void next_item(PlaybackCursor& cursor) const;
+
+	template <typename MB>
+	void get_events(PlaybackCursor& cursor, std::int64_t start_tick, std::int64_t end_tick, int num_samples, MB& midiMessages) const;
+	// Calls f(event, tick) for every event in [start_tick, end_tick) in time order
+	template <typename F>
+	void for_each_event(PlaybackCursor& cursor, std::int64_t start_tick, std::int64_t end_tick, F&& f) const;
+};
+
+// Threads that read playback snapshots. Each one has its own in-use slot.
+enum PlaybackReader
+{
+	AUDIO_READER,
+	LOOKAHEAD_READER,
+	NUM_PLAYBACK_READERS
+};
 
 class DrumData
 {
@@ -86,22 +442,27 @@ public:
 
 	void set_sequence_str(std::string const& sequence);
 	std::string get_sequence_str() const { return m_sequence_str; }
-	int sequence_length() const { return m_sequence_length; }
+	std::int64_t sequence_length() const { return m_sequence->item_count(); }
+	SequenceError const& sequence_error() const { return m_sequence_error; }
 	void play_sequence(bool ps);
 	bool is_playing_sequence() const { return m_play_sequence; }
-	std::vector<SequenceItem> const& get_sequence() const { return m_sequence; }
 
     int beats() const { return m_patterns[m_current_pattern].time_signature.beats; }
     int beat_divisions() const { return m_patterns[m_current_pattern].time_signature.beat_divisions; }
 	int total_divisions() const { return m_patterns[m_current_pattern].time_signature.total_divisions(); }
 	void set_time_signature(int beats, int beat_divisions);
-	bool set_hit_at_time(double beat_time, int note, int velocity);
+	bool set_hit_at_time(std::int64_t tick, int note, int velocity);
 
 
 	int pattern_count() const { return (int)m_patterns.size(); }
+	// Makes room for another page of empty patterns, which cost nothing until used
+	void add_pattern_page();
 
 	void set_swing(float swing);
 
+	bool lookahead_render() const { return m_lookahead_render; }
+	void set_lookahead_render(bool lookahead_render) { m_lookahead_render = lookahead_render; state_changed(); }
+
 	int lane_count() const;
 
 	void set_hit(int lane, int division, int velocity);
@@ -110,55 +471,122 @@ public:
 	void clear_hits();
 	void clear_all();
 
-	std::vector<SequenceItem> const& get_playing_sequence() const;
-	double get_wrapped_time(double time_beats) const;
-	int get_sequence_index(double time_beats) const;
+	Sequence const& get_playing_sequence() const { return *playback().sequence; }
+	std::int64_t get_wrapped_tick(std::int64_t tick) const { return playback().get_wrapped_tick(tick); }
+	int get_sequence_pattern(std::int64_t tick) const { return playback().get_pattern(tick); }
 
-	template <typename MB>
-	void get_events(int pattern, double start_time, double end_time, double offset_time, int num_samples, MB& midiMessages);
-	template <typename MB>
-	void get_events(double start_time, double end_time, int num_samples, MB& midiMessages);
+	// Message thread: the most recently published snapshot.
+	PlaybackSnapshot const& playback() const { return *m_published.load(); }
+	// Audio thread: the snapshot to play from. It stays alive until the reader's
+	// next call, never blocks and never frees memory.
+	PlaybackSnapshot const* acquire_playback(PlaybackReader reader = AUDIO_READER);
+	void release_playback(PlaybackReader reader) { m_in_use[reader].store(nullptr); }
 
-	std::string to_json() const;
-	void from_json(std::string const& json);
+	// Message thread: one pattern's events, for exporting. Compiles them first if stale.
+	template <typename MB>
+	void get_events(int pattern, std::int64_t start_tick, std::int64_t end_tick, std::int64_t offset_tick, MB& midiMessages);
+
+	// The saved state. It is only serialized again when something has changed since
+	// the last call, so hosts that ask often get the same bytes back for free.
+	std::vector<std::uint8_t> const& get_state();
+	// Compact, checksummed binary state. from_binary returns false, and changes
+	// nothing, if the data is damaged or from a newer format.
+	std::vector<std::uint8_t> to_binary() const;
+	bool from_binary(void const* data, std::size_t size);
+	static bool is_binary_state(void const* data, std::size_t size);
+	// The older text state, only read now, for states saved before the binary format.
+	// from_json streams the text without building a document, and returns false,
+	// changing nothing, if it is not valid JSON.
+	bool from_json(std::string const& json);
 
 	void undo();
 	void redo();
-
-	std::string m_midi_file_directory;
+	// Edits between begin and commit become one undo step, and events are only
+	// recompiled and published at the outermost commit. A nonzero merge_id folds
+	// the transaction into the previous undo step if that had the same id.
+	void begin_transaction(int merge_id = 0);
+	void commit_transaction();
+	// A merge id no earlier caller has been given, so steps from different
+	// editors or record passes never fold together
+	int new_merge_id() { return ++m_last_merge_id; }
+	// Bytes held by the undo and redo history. The oldest edits are forgotten
+	// once it grows past the budget.
+	std::size_t undo_memory() const { return m_undo_bytes; }
+	void set_undo_budget(std::size_t bytes);
+	static constexpr std::size_t DEFAULT_UNDO_BUDGET = 256 * 1024;
+
+	std::string const& midi_file_directory() const { return m_midi_file_directory; }
+	void set_midi_file_directory(std::string directory) { m_midi_file_directory = std::move(directory); state_changed(); }
 
 	int get_current_kit() const { return m_current_kit; }
-	void set_current_kit(int kit_index) { m_current_kit = kit_index; }
+	void set_current_kit(int kit_index) { m_current_kit = kit_index; state_changed(); }
 	std::vector<std::string> get_kit_names() const;
 	std::vector<DrumInfo> const &get_current_kit_drums() const;
 	std::string get_drum_name(int note) const;
-	static const int NUM_PATTERNS = 16;
-	using PatternArray = std::array<DrumPattern, NUM_PATTERNS>;
+	// The current version of every pattern. Keep a copy to compare against later.
+	PatternBank const& patterns() const { return m_patterns; }
 
 private:
-	void update_events();
+	// Edits only mark patterns dirty. A dirty pattern is recompiled when a snapshot
+	// that plays it is published, or when it is exported.
+	void mark_dirty(int pattern) { m_events_dirty.set(pattern); }
 	void update_events(int pattern);
+	void update_dirty_events(Sequence const& sequence);
+	DrumEvents const& events(int pattern);
 	void update_sequence();
-	PatternArray m_patterns;
+	void publish();
+	PatternBank m_patterns;
+	PatternPool m_pattern_pool;
+
+	// Bumped by every change that is saved in the state
+	void state_changed() { ++m_state_generation; }
+	std::uint64_t m_state_generation = 1;
+	std::uint64_t m_saved_generation = 0;
+	std::vector<std::uint8_t> m_saved_state;
+	std::vector<std::shared_ptr<const DrumEvents>> m_pattern_events;
+	std::bitset<MAX_PATTERNS> m_events_dirty;
 	int m_current_pattern = 0;
 	float m_swing = 0.5f;
+	bool m_lookahead_render = false;
 
 	std::string m_sequence_str;
-	std::vector<SequenceItem> m_sequence;
-	mutable std::vector<SequenceItem> m_current_pattern_sequence;
+	SequenceError m_sequence_error;
+	std::shared_ptr<const Sequence> m_sequence = std::make_shared<const Sequence>();
 	bool m_play_sequence = false;
-	int m_sequence_length = 0;
 
 	DrumDataListener& m_listener;
 
-	std::vector<Action> m_undo_stack;
-	std::vector<Action> m_redo_stack;
-
-	void do_action(std::function<void()> do_action, std::function<void()> undo_action);
-
-	std::vector<DrumKit> m_kits;
+	std::deque<UndoRecord> m_undo_stack;
+	std::vector<UndoRecord> m_redo_stack;
+	std::size_t m_undo_budget = DEFAULT_UNDO_BUDGET;
+	std::size_t m_undo_bytes = 0;
+
+	// Applies edit to one pattern and records what it changed for undo
+	template <typename F>
+	void do_action(int pattern_id, F&& edit);
+	void push_undo(UndoRecord record);
+	void trim_undo();
+	// A loaded state replaces the patterns the history was recorded against
+	void clear_undo();
+	void apply_record(UndoRecord const& record, bool forward);
+
+	int m_transaction_depth = 0;
+	int m_transaction_merge_id = 0;
+	int m_last_merge_id = 0;
+	// The patterns as they were when the open transaction began, and which it touched
+	PatternBank m_transaction_before;
+	std::bitset<MAX_PATTERNS> m_transaction_touched;
+
+	// Snapshots are only ever freed here, on the message thread, once they are neither
+	// published nor marked as in use by the audio thread.
+	std::vector<std::unique_ptr<const PlaybackSnapshot>> m_snapshots;
+	std::uint64_t m_generation = 0;
+	std::atomic<const PlaybackSnapshot*> m_published = nullptr;
+	std::array<std::atomic<const PlaybackSnapshot*>, NUM_PLAYBACK_READERS> m_in_use{};
+
+	std::shared_ptr<const KitLibrary> m_kits = KitLibrary::get();
 	int m_current_kit = 0;
-	void load_kits();
+	std::string m_midi_file_directory;
 
 };
 
@@ -169,45 +597,102 @@ private:
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 template <typename MB>
-inline void DrumData::get_events(int pattern, double start_time, double end_time, double offset_time, int num_samples, MB& midiMessages)
+inline void DrumData::get_events(int pattern, std::int64_t start_tick, std::int64_t end_tick, std::int64_t offset_tick, MB& midiMessages)
 {
-	for (auto& e : m_patterns[pattern].m_events) {
-		if (e.beat_time >= start_time && e.beat_time < end_time) {
-			double time_fraction = (e.beat_time + offset_time - start_time) / (end_time - start_time);
-			auto sample_time = static_cast<int>(time_fraction * num_samples);
-			midiMessages.addEvent(juce::MidiMessage::noteOn(1, e.note, juce::uint8(e.velocity)), sample_time);
-		}
+	auto const& events = this->events(pattern);
+	auto e = std::lower_bound(events.begin(), events.end(), start_tick,
+		[](DrumEvent const& event, std::int64_t tick) { return event.tick < tick; });
+	for (; e != events.end() && e->tick < end_tick; ++e) {
+		midiMessages.addEvent(juce::MidiMessage::noteOn(1, e->note, juce::uint8(e->velocity)), double(e->tick - start_tick + offset_tick));
 	}
 }
 
 template <typename MB>
-inline void DrumData::get_events(double start_time, double end_time, int num_samples, MB& midiMessages)
+inline void PlaybackSnapshot::get_events(PlaybackCursor& cursor, std::int64_t start_tick, std::int64_t end_tick, int num_samples, MB& midiMessages) const
+{
+	// A start within CONTINUITY_TICKS of where the last block ended picks up from there.
+	// This holds across a new snapshot too, for_each_event re-seeks the cursor into it.
+	if (std::abs(start_tick - cursor.end_tick) <= CONTINUITY_TICKS) {
+		start_tick = cursor.end_tick;
+	}
+	if (end_tick <= start_tick) {
+		return;
+	}
+	for_each_event(cursor, start_tick, end_tick, [&](DrumEvent const& e, std::int64_t tick) {
+		auto sample_time = static_cast<int>((tick - start_tick) * num_samples / (end_tick - start_tick));
+		midiMessages.addEvent(juce::MidiMessage::noteOn(1, e.note, juce::uint8(e.velocity)), sample_time);
+		});
+}
+
+template <typename F>
+inline void PlaybackSnapshot::for_each_event(PlaybackCursor& cursor, std::int64_t start_tick, std::int64_t end_tick, F&& f) const
 {
-	auto const& sequence = get_playing_sequence();
-	if (sequence.size() == 0) {
+	if (length_ticks <= 0 || end_tick <= start_tick) {
 		return;
 	}
-	double sequence_length_beats = sequence.back().end_beat;
-	double start_time_wrap = fmod(start_time, sequence_length_beats);
-	double num_wraps = std::floor(start_time / sequence_length_beats);
-	double end_time_wrap = end_time - start_time + start_time_wrap;
-	int seq_index = get_sequence_index(start_time);
-
-	double time = start_time;
-	while (time < end_time) {
-		auto& item = sequence[seq_index];
-		get_events(item.pattern,
-			       start_time_wrap - item.start_beat,
-			       end_time_wrap - item.start_beat,
-			       item.start_beat + num_wraps * sequence_length_beats,
-			       num_samples,
-			       midiMessages);
-		time += item.end_beat - start_time_wrap;
-		seq_index = (seq_index + 1) % sequence.size();
-		if (seq_index == 0) {
-			num_wraps += 1.;
-			start_time_wrap -= sequence_length_beats;
-			end_time_wrap -= sequence_length_beats;
+	if (cursor.generation != generation || start_tick != cursor.end_tick) {
+		seek(cursor, start_tick);
+	}
+	cursor.end_tick = end_tick;
+
+	const auto none = std::numeric_limits<std::int64_t>::max();
+	for (;;) {
+		auto& item = cursor.item;
+		auto& events = *pattern_events[item.pattern];
+		auto& overhang = *pattern_events[cursor.previous.pattern];
+		auto item_length = item.end_tick - item.start_tick;
+		auto previous_length = cursor.previous.end_tick - cursor.previous.start_tick;
+		// Merge this item's own events with the previous item's overhang
+		for (;;) {
+			auto tick = none;
+			if (cursor.event_index < events.size() && events[cursor.event_index].tick < item_length) {
+				tick = item.start_tick + events[cursor.event_index].tick;
+			}
+			auto overhang_tick = none;
+			if (cursor.overhang_index < overhang.size() && overhang[cursor.overhang_index].tick - previous_length < item_length) {
+				overhang_tick = item.start_tick + overhang[cursor.overhang_index].tick - previous_length;
+			}
+			if (tick == none && overhang_tick == none) {
+				break;
+			}
+			if (std::min(tick, overhang_tick) >= end_tick) {
+				return;
+			}
+			if (overhang_tick <= tick) {
+				f(overhang[cursor.overhang_index++], overhang_tick);
+			}
+			else {
+				f(events[cursor.event_index++], tick);
+			}
+		}
+		if (item.end_tick >= end_tick) {
+			return;
+		}
+		next_item(cursor);
+	}
+}
+
+template <typename F>
+inline void Sequence::for_each_item(F&& f) const
+{
+	if (!empty()) {
+		for_each_item(m_root, 0, f);
+	}
+}
+
+template <typename F>
+inline void Sequence::for_each_item(int node_id, std::int64_t start_tick, F& f) const
+{
+	auto& node = m_nodes[node_id];
+	for (std::int64_t pass = 0; pass < node.repeat; ++pass) {
+		auto pass_start = start_tick + pass * node.length_ticks;
+		if (node.pattern >= 0) {
+			f(SequenceItem{ pass_start, pass_start + node.length_ticks, node.pattern });
+			continue;
+		}
+		for (int i = 0; i < node.child_count; ++i) {
+			auto child = m_children[node.first_child + i];
+			for_each_item(child, pass_start + m_nodes[child].start_tick, f);
 		}
 	}
 }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <vector>
+#include <atomic>
+
+// Wait-free single producer, single consumer queue. Storage is allocated up front,
+// so push and pop never allocate or lock. A push onto a full queue is dropped and
+// counted so the consumer can report it.
+template <typename T>
+class LockFreeFifo
+{
+public:
+	// AbstractFifo keeps one slot free to tell full from empty
+	explicit LockFreeFifo(int capacity) : m_fifo(capacity + 1), m_items(capacity + 1) {}
+
+	bool push(T const& item)
+	{
+		int start1, size1, start2, size2;
+		m_fifo.prepareToWrite(1, start1, size1, start2, size2);
+		if (size1 + size2 == 0) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		m_items[size1 > 0 ? start1 : start2] = item;
+		m_fifo.finishedWrite(1);
+		return true;
+	}
+
+	bool pop(T& item)
+	{
+		int start1, size1, start2, size2;
+		m_fifo.prepareToRead(1, start1, size1, start2, size2);
+		if (size1 + size2 == 0) {
+			return false;
+		}
+		item = m_items[size1 > 0 ? start1 : start2];
+		m_fifo.finishedRead(1);
+		return true;
+	}
+
+	// Consumer only: the oldest item without removing it, or nullptr when empty
+	T const* front() const
+	{
+		int start1, size1, start2, size2;
+		m_fifo.prepareToRead(1, start1, size1, start2, size2);
+		if (size1 + size2 == 0) {
+			return nullptr;
+		}
+		return &m_items[size1 > 0 ? start1 : start2];
+	}
+
+	int size() const { return m_fifo.getNumReady(); }
+	int capacity() const { return m_fifo.getTotalSize() - 1; }
+	int dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+	juce::AbstractFifo m_fifo;
+	std::vector<T> m_items;
+	std::atomic<int> m_dropped = 0;
+};
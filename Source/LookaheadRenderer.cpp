@@ -0,0 +1,136 @@
+#include "LookaheadRenderer.h"
+
+LookaheadRenderer::LookaheadRenderer(DrumData& data)
+	: juce::Thread("Lookahead Renderer"), m_data(data)
+{
+}
+
+LookaheadRenderer::~LookaheadRenderer()
+{
+	stopThread(1000);
+}
+
+void LookaheadRenderer::set_enabled(bool enabled)
+{
+	if (enabled == is_enabled()) {
+		return;
+	}
+	if (enabled) {
+		startThread(juce::Thread::Priority::low);
+	}
+	m_enabled.store(enabled, std::memory_order_relaxed);
+	if (!enabled) {
+		stopThread(1000);
+	}
+}
+
+void LookaheadRenderer::get_events(PlaybackSnapshot const& playback, PlaybackCursor& cursor,
+	std::int64_t start_tick, std::int64_t end_tick, int num_samples, juce::MidiBuffer& midiMessages)
+{
+	if (std::abs(start_tick - m_expected_tick) <= CONTINUITY_TICKS) {
+		start_tick = m_expected_tick;
+	}
+	else {
+		// Relocated: everything already in the ring is for the wrong place
+		m_request_tick.store(start_tick, std::memory_order_relaxed);
+		m_request_epoch.store(++m_epoch, std::memory_order_release);
+	}
+	m_expected_tick = end_tick;
+	m_play_tick.store(end_tick, std::memory_order_relaxed);
+	if (end_tick <= start_tick) {
+		return;
+	}
+
+	auto add_event = [&](int note, int velocity, std::int64_t tick) {
+		auto sample_time = static_cast<int>((tick - start_tick) * num_samples / (end_tick - start_tick));
+		midiMessages.addEvent(juce::MidiMessage::noteOn(1, note, juce::uint8(velocity)), sample_time);
+		};
+
+	auto tick = start_tick;
+	while (tick < end_tick) {
+		auto slice_start = floor_div(tick, SLICE_TICKS) * SLICE_TICKS;
+		auto slice_end = slice_start + SLICE_TICKS;
+		auto part_end = std::min(end_tick, slice_end);
+
+		// Drop slices that are stale or already played
+		auto slice = m_slices.front();
+		while (slice && (slice->epoch != m_epoch || slice->generation < playback.generation || slice->start_tick < slice_start)) {
+			RenderedSlice discarded;
+			m_slices.pop(discarded);
+			slice = m_slices.front();
+		}
+
+		if (slice && slice->start_tick == slice_start && slice->generation == playback.generation && !slice->overflow) {
+			for (int i = 0; i < slice->count; ++i) {
+				auto& e = slice->events[i];
+				if (e.tick >= tick && e.tick < part_end) {
+					add_event(e.note, e.velocity, e.tick);
+				}
+			}
+			if (slice_end <= end_tick) {
+				RenderedSlice played;
+				m_slices.pop(played);
+			}
+		}
+		else {
+			playback.for_each_event(cursor, tick, part_end, [&](DrumEvent const& e, std::int64_t event_tick) {
+				add_event(e.note, e.velocity, event_tick);
+				});
+		}
+		tick = part_end;
+	}
+}
+
+void LookaheadRenderer::render_slice(PlaybackSnapshot const& playback, PlaybackCursor& cursor, RenderedSlice& slice)
+{
+	slice.overflow = false;
+	slice.count = 0;
+	playback.for_each_event(cursor, slice.start_tick, slice.start_tick + SLICE_TICKS, [&](DrumEvent const& e, std::int64_t tick) {
+		if (slice.count == MAX_SLICE_EVENTS) {
+			slice.overflow = true;
+			return;
+		}
+		slice.events[slice.count++] = { tick, e.note, e.velocity };
+		});
+}
+
+void LookaheadRenderer::run()
+{
+	std::uint32_t epoch = 0;
+	std::uint64_t generation = 0;
+	std::int64_t next_tick = 0;
+	std::int64_t waited_tick = -1;
+	PlaybackCursor cursor;
+	RenderedSlice slice;
+
+	while (!threadShouldExit()) {
+		auto request_epoch = m_request_epoch.load(std::memory_order_acquire);
+		auto request_tick = m_request_tick.load(std::memory_order_relaxed);
+		auto play_tick = m_play_tick.load(std::memory_order_relaxed);
+		auto const& playback = *m_data.acquire_playback(LOOKAHEAD_READER);
+
+		if (request_epoch != epoch) {
+			epoch = request_epoch;
+			next_tick = floor_div(request_tick, SLICE_TICKS) * SLICE_TICKS;
+		}
+		else if (playback.generation != generation || next_tick < play_tick) {
+			// An edit, or we fell behind: carry on from where the audio thread is
+			next_tick = floor_div(play_tick, SLICE_TICKS) * SLICE_TICKS;
+		}
+		generation = playback.generation;
+
+		if (next_tick >= play_tick + LOOKAHEAD_TICKS || m_slices.size() >= m_slices.capacity()) {
+			// Nothing to do until the audio thread moves on, which it does not while stopped
+			wait(play_tick == waited_tick ? STOPPED_WAIT_MS : PLAYING_WAIT_MS);
+			waited_tick = play_tick;
+			continue;
+		}
+		slice.epoch = epoch;
+		slice.generation = generation;
+		slice.start_tick = next_tick;
+		render_slice(playback, cursor, slice);
+		m_slices.push(slice);
+		next_tick += SLICE_TICKS;
+	}
+	m_data.release_playback(LOOKAHEAD_READER);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "DrumData.h"
+#include "LockFreeFifo.h"
+
+#include <array>
+#include <atomic>
+
+// Optional low priority worker that renders playback a couple of beats ahead of the
+// audio thread, in fixed slices of ticks. processBlock then only copies the slices
+// covering its block. Anything the ring cannot supply (after an edit, a relocation,
+// or when the worker falls behind) is rendered directly on the audio thread.
+class LookaheadRenderer : private juce::Thread
+{
+public:
+	LookaheadRenderer(DrumData& data);
+	~LookaheadRenderer() override;
+
+	// Message thread
+	void set_enabled(bool enabled);
+	bool is_enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+	// Audio thread
+	void get_events(PlaybackSnapshot const& playback, PlaybackCursor& cursor,
+		std::int64_t start_tick, std::int64_t end_tick, int num_samples, juce::MidiBuffer& midiMessages);
+
+	static constexpr int SLICE_TICKS = TICKS_PER_BEAT / 16;
+	static constexpr int LOOKAHEAD_TICKS = TICKS_PER_BEAT * 2;
+	static constexpr int MAX_SLICE_EVENTS = MAX_LANES * 4;
+	static constexpr int RING_SLICES = 2 * LOOKAHEAD_TICKS / SLICE_TICKS;
+	// How long the worker sleeps once it is far enough ahead, while the audio thread
+	// is playing and while it is stopped. The audio thread renders directly whatever
+	// the ring is missing after a relocation, so waking late only costs CPU there.
+	static constexpr int PLAYING_WAIT_MS = 5;
+	static constexpr int STOPPED_WAIT_MS = 50;
+
+private:
+	struct RenderedEvent
+	{
+		std::int64_t tick;
+		int note;
+		int velocity;
+	};
+
+	// Every event in [start_tick, start_tick + SLICE_TICKS) for one relocation epoch
+	// and snapshot generation. An overflowed slice is never played from.
+	struct RenderedSlice
+	{
+		std::uint32_t epoch = 0;
+		std::uint64_t generation = 0;
+		std::int64_t start_tick = 0;
+		bool overflow = false;
+		int count = 0;
+		std::array<RenderedEvent, MAX_SLICE_EVENTS> events;
+	};
+
+	void run() override;
+	void render_slice(PlaybackSnapshot const& playback, PlaybackCursor& cursor, RenderedSlice& slice);
+
+	DrumData& m_data;
+	LockFreeFifo<RenderedSlice> m_slices{ RING_SLICES };
+	std::atomic<bool> m_enabled = false;
+
+	// Written by the audio thread, read by the worker
+	std::atomic<std::uint32_t> m_request_epoch = 0;
+	std::atomic<std::int64_t> m_request_tick = 0;
+	std::atomic<std::int64_t> m_play_tick = 0;
+
+	// Audio thread only
+	std::uint32_t m_epoch = 0;
+	std::int64_t m_expected_tick = 0;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LookaheadRenderer)
+};
@@ -34,14 +34,24 @@ DrummerQueenAudioProcessorEditor::DrummerQueenAudioProcessorEditor (DrummerQueen
     }
 	m_velocity_buttons.front()->setToggleState(true, juce::dontSendNotification);
 
-    int n_patterns = data().pattern_count();
-    for (int p_index = 0; p_index < n_patterns; ++p_index) {
+    // One page of buttons, relabelled as the page changes
+    for (int p_index = 0; p_index < PATTERN_PAGE_SIZE; ++p_index) {
         m_pattern_buttons.emplace_back(std::make_unique<PatternButton>(this, p_index));
-        m_pattern_buttons.back()->onClick = [this, p_index] {set_pattern(p_index, false); };
+        m_pattern_buttons.back()->onClick = [this, p_index] {set_pattern(m_pattern_buttons[p_index]->pattern(), false); };
         m_pattern_buttons.back()->setRadioGroupId(2);
         m_pattern_button_parent.addAndMakeVisible(m_pattern_buttons.back().get());
     }
     addAndMakeVisible(m_pattern_button_parent);
+    m_prev_page_button.onClick = [this] { show_pattern_page(m_pattern_page - 1); };
+    m_next_page_button.onClick = [this] {
+        // Paging past the last page adds a new one
+        if ((m_pattern_page + 1) * PATTERN_PAGE_SIZE >= data().pattern_count()) {
+            data().add_pattern_page();
+        }
+        show_pattern_page(m_pattern_page + 1);
+        };
+    addAndMakeVisible(m_prev_page_button);
+    addAndMakeVisible(m_next_page_button);
     update_pattern_buttons();
 
 	m_sequence_editor.setText(data().get_sequence_str());
@@ -49,7 +59,15 @@ DrummerQueenAudioProcessorEditor::DrummerQueenAudioProcessorEditor (DrummerQueen
 	m_sequence_editor.onTextChange = [this] {
             data().set_sequence_str(m_sequence_editor.getText().toStdString());
 			m_sequence_editor.setText(data().get_sequence_str(), juce::dontSendNotification);
-			m_sequence_length_label.setText(std::format("Len: {}", data().sequence_length()), juce::dontSendNotification);
+			auto& error = data().sequence_error();
+			if (error) {
+				m_sequence_length_label.setText(std::format("Err: {}", error.position + 1), juce::dontSendNotification);
+				m_sequence_length_label.setTooltip(error.message);
+			}
+			else {
+				m_sequence_length_label.setText(std::format("Len: {}", data().sequence_length()), juce::dontSendNotification);
+				m_sequence_length_label.setTooltip({});
+			}
         };
 	addAndMakeVisible(m_play_sequence_button);
     m_play_sequence_button.setToggleState(data().is_playing_sequence(), juce::dontSendNotification);
@@ -127,23 +145,37 @@ DrummerQueenAudioProcessorEditor::DrummerQueenAudioProcessorEditor (DrummerQueen
 	//m_time_slice_thread.startThread();
 	//m_directory_contents.setDirectory(juce::File::getSpecialLocation(juce::File::userDocumentsDirectory), true, true);
 	addAndMakeVisible(m_file_list);
-	m_file_list.setRoot(juce::File(data().m_midi_file_directory));
+	m_file_list.setRoot(juce::File(data().midi_file_directory()));
 	m_file_list.addListener(this);
 
+	// A pass may already be under way if the editor was reopened while recording
+	m_record_pass = data().new_merge_id();
 	m_record_button.onStateChange = [this]() {
 		audioProcessor.recording(m_record_button.getToggleState());
 		};
+    m_record_button.onClick = [this]() {
+        if (m_record_button.getToggleState()) {
+            m_record_pass = data().new_merge_id();
+        }
+        };
     addAndMakeVisible(m_record_button);
     addAndMakeVisible(m_bpm_editor);
+    m_dropped_label.setColour(juce::Label::textColourId, juce::Colours::red);
+    addAndMakeVisible(m_dropped_label);
+    m_lookahead_button.setToggleState(audioProcessor.lookahead_render(), juce::dontSendNotification);
+    m_lookahead_button.onClick = [this] { audioProcessor.set_lookahead_render(m_lookahead_button.getToggleState()); };
+    addAndMakeVisible(m_lookahead_button);
 
     layout_components();
     setSize(1124, 448);
-    audioProcessor.addChangeListener(this);
+    // Poll the transport at display rate rather than reacting to every audio block
+    startTimerHz(30);
 }
 
 DrummerQueenAudioProcessorEditor::~DrummerQueenAudioProcessorEditor()
 {
-    audioProcessor.removeChangeListener(this);
+    stopTimer();
+    audioProcessor.all_notes_off();
 }
 
 //==============================================================================
@@ -178,17 +210,20 @@ void DrummerQueenAudioProcessorEditor::layout_components()
     const int butt_size = 24;
     const int butt_spacing = butt_size + 2;
 
-    const int n_patterns = data().pattern_count();
-    const int butt_per_line = n_patterns / 2;
-    m_pattern_button_parent.setBounds(m_grid_left, 8, butt_spacing * n_patterns / 2, butt_spacing * 2);
+    const int butt_per_line = PATTERN_PAGE_SIZE / 2;
+    m_pattern_button_parent.setBounds(m_grid_left, 8, butt_spacing * butt_per_line, butt_spacing * 2);
     int i = 0;
     for (auto& pb : m_pattern_buttons) {
         pb->setBounds(butt_spacing * (i % butt_per_line), butt_spacing * (i / butt_per_line), butt_size, butt_size);
         ++i;
     }
+    m_prev_page_button.setBounds(m_pattern_button_parent.getRight(), 8, butt_size, butt_size);
+    m_next_page_button.setBounds(m_pattern_button_parent.getRight(), 8 + butt_spacing, butt_size, butt_size);
 
-    m_record_button.setBounds(m_pattern_button_parent.getRight() + 8, 8, 48, 48);
+    m_record_button.setBounds(m_next_page_button.getRight() + 8, 8, 48, 48);
 	m_bpm_editor.setBounds(m_record_button.getRight() + 8, 8, 80, 48);
+    m_dropped_label.setBounds(m_bpm_editor.getRight() + 8, 8, 120, 24);
+    m_lookahead_button.setBounds(m_bpm_editor.getRight() + 8, 32, 120, 24);
 
     int x = m_grid_left;
     for (auto& vb : m_velocity_buttons) {
@@ -221,28 +256,44 @@ void DrummerQueenAudioProcessorEditor::mouseWheelMove(const juce::MouseEvent&, c
     }
 }
 
-void DrummerQueenAudioProcessorEditor::changeListenerCallback(juce::ChangeBroadcaster*)
+void DrummerQueenAudioProcessorEditor::timerCallback()
 {
 	auto midi_events = audioProcessor.get_recorded_midi();
 	bool update_pattern = false;
-	for (auto& e : midi_events) {
-        update_pattern |= data().set_hit_at_time(e.beat_time, e.note, e.velocity);
-	}
+    if (!midi_events.empty()) {
+        // Everything recorded in one pass is a single undo step
+        data().begin_transaction(m_record_pass);
+        for (auto& e : midi_events) {
+            update_pattern |= data().set_hit_at_time(e.tick, e.note, e.velocity);
+        }
+        data().commit_transaction();
+    }
 	if (update_pattern) {
 		set_pattern(data().get_current_pattern_id());
 		resize_grid();
 	}
-	m_bpm_editor.setText(std::format("{:.2f}", audioProcessor.bpm()), juce::dontSendNotification);
+    auto dropped = audioProcessor.dropped_recorded_midi();
+    if (dropped != m_shown_dropped) {
+        m_shown_dropped = dropped;
+        m_dropped_label.setText(std::format("Dropped: {}", dropped), juce::dontSendNotification);
+    }
+    auto bpm = audioProcessor.bpm();
+    if (bpm != m_shown_bpm) {
+        m_shown_bpm = bpm;
+        m_bpm_editor.setText(std::format("{:.2f}", bpm), juce::dontSendNotification);
+    }
     auto bar_pos_beats = audioProcessor.barPos();
-    m_grid.set_position(bar_pos_beats);
-    if (bar_pos_beats > 0.f && data().is_playing_sequence()) {
-        auto index = data().get_sequence_index(bar_pos_beats);
-        auto pattern = data().get_playing_sequence()[index].pattern;
-        if (pattern != data().get_current_pattern_id()) {
+    if (audioProcessor.isPlaying() && data().is_playing_sequence()) {
+        auto pattern = audioProcessor.sequencePattern();
+        if (pattern >= 0 && pattern < data().pattern_count() && pattern != data().get_current_pattern_id()) {
             set_pattern(pattern);
         }
     }
-    repaint();
+    if (bar_pos_beats != m_shown_bar_pos || midi_events.size() > 0) {
+        m_shown_bar_pos = bar_pos_beats;
+        m_grid.set_position(bar_pos_beats);
+        m_grid.repaint();
+    }
 }
 
 void DrummerQueenAudioProcessorEditor::delete_lane()
@@ -304,9 +355,11 @@ namespace {
 
         std::map<int, int> lane_from_note;
         for (auto note : notes) {
-            pattern.lanes.push_back({ pattern.time_signature.total_divisions() });
-            pattern.lanes.back().note = note;
-            lane_from_note[note] = (int)pattern.lanes.size() - 1;
+            if (pattern.lane_count == MAX_LANES) {
+                break;
+            }
+            pattern.add_lane(note);
+            lane_from_note[note] = pattern.lane_count - 1;
         }
 
         for (int i = 0; i < num_tracks; ++i) {
@@ -315,10 +368,10 @@ namespace {
                 auto& e = track->getEventPointer(j)->message;
                 if (e.isNoteOn()) {
                     int note = e.getNoteNumber();
-                    int lane = lane_from_note[note];
+                    auto lane = lane_from_note.find(note);
                     int division = static_cast<int>(pattern.time_signature.beat_divisions * e.getTimeStamp() / ticks_per_beat);
-                    if (division >= 0 && division < pattern.time_signature.total_divisions()) {
-                        pattern.lanes[lane].velocity[division] = e.getVelocity();
+                    if (lane != lane_from_note.end() && division >= 0 && division < pattern.time_signature.total_divisions()) {
+                        pattern.lanes[lane->second].set_velocity(division, e.getVelocity());
                     }
                 }
             }
@@ -336,7 +389,6 @@ void DrummerQueenAudioProcessorEditor::drag_onto_pattern(int pattern_index, cons
 	}
 	data().set_pattern(pattern_index, import_midi_file(file));
 	set_pattern(pattern_index);
-    m_pattern_buttons[pattern_index]->setToggleState(true, juce::dontSendNotification);
 	m_grid.repaint();
 }
 
@@ -351,13 +403,16 @@ void DrummerQueenAudioProcessorEditor::set_pattern(int index, bool update_button
 {
     data().set_current_pattern(index);
     if (update_button) {
-        m_pattern_buttons[index]->setToggleState(true, juce::dontSendNotification);
+        update_pattern_buttons();
     }
     auto const &pattern = data().get_current_pattern();
     for (auto& pb : m_lane_combo_boxes) {
         removeChildComponent(pb.get());
     }
     for (auto& pb : m_lane_name_buttons) {
+        if (pb->m_audition_note >= 0) {
+            audioProcessor.stop_note(pb->m_audition_note);
+        }
         removeChildComponent(pb.get());
     }
 
@@ -382,9 +437,15 @@ void DrummerQueenAudioProcessorEditor::set_pattern(int index, bool update_button
         m_lane_name_buttons.back()->setBounds(m_lane_button_left, y, m_lane_button_width, 25);
 		m_lane_name_buttons.back()->setConnectedEdges(juce::Button::ConnectedOnLeft | juce::Button::ConnectedOnRight);
 		m_lane_name_buttons.back()->onStateChange = [this, i] {
-				if (m_lane_name_buttons[i]->getState() == juce::Button::buttonDown) {
-                    audioProcessor.play_note(data().get_current_pattern().lanes[i].note);;
+                auto& button = *m_lane_name_buttons[i];
+				if (button.getState() == juce::Button::buttonDown && button.m_audition_note < 0) {
+                    button.m_audition_note = data().get_current_pattern().lanes[i].note;
+                    audioProcessor.play_note(button.m_audition_note);
 				}
+                else if (button.getState() != juce::Button::buttonDown && button.m_audition_note >= 0) {
+                    audioProcessor.stop_note(button.m_audition_note);
+                    button.m_audition_note = -1;
+                }
 			};
 		addAndMakeVisible(*m_lane_name_buttons.back());
         y += 24;
@@ -413,7 +474,23 @@ void DrummerQueenAudioProcessorEditor::set_pattern(int index, bool update_button
 
 void DrummerQueenAudioProcessorEditor::update_pattern_buttons()
 {
-    m_pattern_buttons[data().get_current_pattern_id()]->setToggleState(true, juce::dontSendNotification);
+    show_pattern_page(data().get_current_pattern_id() / PATTERN_PAGE_SIZE);
+}
+
+void DrummerQueenAudioProcessorEditor::show_pattern_page(int page)
+{
+    int page_count = (data().pattern_count() + PATTERN_PAGE_SIZE - 1) / PATTERN_PAGE_SIZE;
+    m_pattern_page = std::clamp(page, 0, page_count - 1);
+    int current = data().get_current_pattern_id();
+    for (int i = 0; i < PATTERN_PAGE_SIZE; ++i) {
+        auto& pb = *m_pattern_buttons[i];
+        pb.set_pattern(m_pattern_page * PATTERN_PAGE_SIZE + i);
+        pb.setEnabled(pb.pattern() < data().pattern_count());
+        pb.setToggleState(pb.pattern() == current, juce::dontSendNotification);
+    }
+    m_prev_page_button.setEnabled(m_pattern_page > 0);
+    m_next_page_button.setEnabled(m_pattern_page + 1 < page_count || data().pattern_count() < MAX_PATTERNS);
+    m_next_page_button.setButtonText(m_pattern_page + 1 < page_count ? ">" : "+");
 }
 
 void DrummerQueenAudioProcessorEditor::add_time_signature(char const* name, int beats, int beat_divisions)
@@ -441,7 +518,7 @@ void DrummerQueenAudioProcessorEditor::selectionChanged()
 
 void DrummerQueenAudioProcessorEditor::browserRootChanged(const juce::File& newRoot)
 {
-	data().m_midi_file_directory = newRoot.getFullPathName().toStdString();
+	data().set_midi_file_directory(newRoot.getFullPathName().toStdString());
 }
 
 void drag_midi_sequence(std::vector<SequenceItem> const& sequence, DrumData &data, const char *suffix)
@@ -450,13 +527,11 @@ void drag_midi_sequence(std::vector<SequenceItem> const& sequence, DrumData &dat
 	std::string filename = "dq_pattern";
     juce::File tempFile = tempDirectory.getChildFile(std::format("pattern{}.midi", suffix));
     juce::MidiMessageSequence midi_sequence;
-    int tpq = 960;
     for (auto p : sequence) {
-        auto pattern_length = p.end_beat - p.start_beat;
-        data.get_events(p.pattern, 0., pattern_length, p.start_beat, int(pattern_length * tpq), midi_sequence);
+        data.get_events(p.pattern, 0, p.end_tick - p.start_tick, p.start_tick, midi_sequence);
     }
     juce::MidiFile midi_file;
-    midi_file.setTicksPerQuarterNote(tpq);
+    midi_file.setTicksPerQuarterNote(TICKS_PER_BEAT);
     midi_file.addTrack(midi_sequence);
     auto stream = tempFile.createOutputStream();
     if (stream) {
@@ -471,5 +546,16 @@ void drag_midi_sequence(std::vector<SequenceItem> const& sequence, DrumData &dat
 
 void DrummerQueenAudioProcessorEditor::drag_midi()
 {
-	drag_midi_sequence(data().get_playing_sequence(), data());
+	// The MIDI file holds every play of every pattern, so refuse songs that would
+	// not fit in memory rather than expanding them
+	auto& sequence = data().get_playing_sequence();
+	if (sequence.item_count() > MAX_DRAG_ITEMS) {
+		m_sequence_length_label.setText("Too long", juce::dontSendNotification);
+		m_sequence_length_label.setTooltip(std::format("Songs of more than {} patterns can not be dragged out as MIDI", MAX_DRAG_ITEMS));
+		return;
+	}
+	std::vector<SequenceItem> items;
+	items.reserve(std::size_t(sequence.item_count()));
+	sequence.for_each_item([&items](SequenceItem const& item) { items.push_back(item); });
+	drag_midi_sequence(items, data());
 }
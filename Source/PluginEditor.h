@@ -10,7 +10,7 @@
 
 class DrummerQueenAudioProcessorEditor
   : public juce::AudioProcessorEditor,
-    public juce::ChangeListener,
+    public juce::Timer,
     public juce::Slider::Listener,
     public juce::FileBrowserListener
 {
@@ -23,7 +23,7 @@ public:
     void mouseWheelMove(const juce::MouseEvent& event,
         const juce::MouseWheelDetails& wheel) override;
 
-    void changeListenerCallback(juce::ChangeBroadcaster*) override;
+    void timerCallback() override;
 
     void resize_grid();
     void layout_components();
@@ -34,10 +34,14 @@ public:
 	void drag_onto_pattern(int pattern, const juce::String& files);
     DrumData& data() { return audioProcessor.m_data; }
 private:
+	// Longest song, in pattern plays, that drag_midi will export
+	static constexpr std::int64_t MAX_DRAG_ITEMS = 100000;
+
     void drag_midi();
     void sliderValueChanged(juce::Slider* slider) override;
     void set_pattern(int i, bool update_button = true);
     void update_pattern_buttons();
+    void show_pattern_page(int page);
     // This reference is provided as a quick way for your editor to
     // access the processor object that created it.
     DrummerQueenAudioProcessor& audioProcessor;
@@ -47,6 +51,9 @@ private:
 	int m_velocity_button_selected = 0;
     juce::Component m_pattern_button_parent;
     std::vector<std::unique_ptr<PatternButton>> m_pattern_buttons;
+    int m_pattern_page = 0;
+    juce::TextButton m_prev_page_button{ "<" };
+    juce::TextButton m_next_page_button{ ">" };
 
     std::vector<std::unique_ptr<LaneButton>> m_lane_name_buttons;
     std::vector<std::unique_ptr<juce::ComboBox>> m_lane_combo_boxes;
@@ -66,6 +73,10 @@ private:
     juce::TextEditor m_bpm_editor;
 
 	RecordButton m_record_button;
+    int m_record_pass = 0;
+    juce::Label m_dropped_label;
+    int m_shown_dropped = 0;
+    juce::ToggleButton m_lookahead_button{ "Pre-render" };
 
     int m_velocity = 127;
 
@@ -92,6 +103,9 @@ private:
     void fileDoubleClicked(const juce::File &) override {}
     void browserRootChanged(const juce::File & newRoot) override;
 
+    double m_shown_bar_pos = -1.;
+    double m_shown_bpm = -1.;
+
     int m_note_width = 24;
     int m_note_height = 24;
 
@@ -17,13 +17,13 @@ DrummerQueenAudioProcessor::DrummerQueenAudioProcessor()
 #endif
     m_data(*this)
 {
-	m_midi_messages.reserve(MAX_MIDI_MESSAGES);
     addParameter(m_swing = new juce::AudioParameterFloat("swing", // parameterID
         "Swing", // parameter name
         0.0f, // minimum value
         1.0f, // maximum value
         0.5f)); // default value
 
+    m_data.begin_transaction();
     m_data.add_drum("Kick", 36);
     m_data.add_drum("Side Stick", 37);
     m_data.add_drum("Snare", 38);
@@ -34,6 +34,7 @@ DrummerQueenAudioProcessor::DrummerQueenAudioProcessor()
     m_data.add_drum("Ride", 51);
     m_data.add_drum("Bell", 53);
     m_data.add_drum("Crash", 49);
+    m_data.commit_transaction();
 }
 
 DrummerQueenAudioProcessor::~DrummerQueenAudioProcessor()
@@ -105,8 +106,13 @@ void DrummerQueenAudioProcessor::changeProgramName (int, const juce::String&)
 //==============================================================================
 void DrummerQueenAudioProcessor::prepareToPlay (double, int)
 {
-    // Use this method as the place to do any pre-playback
-    // initialisation that you need..
+    // Everything processBlock touches is sized here so the audio thread never allocates
+    m_zero_position_buffer.clear();
+    m_zero_position_buffer.ensureSize(MAX_EVENTS_PER_BLOCK * MIDI_BUFFER_BYTES_PER_EVENT);
+    // Room for whatever the host passes in as well as what processBlock adds
+    m_spare_output_buffer.clear();
+    m_spare_output_buffer.ensureSize(2 * MAX_OUTPUT_BYTES);
+    m_cursor = {};
 }
 
 void DrummerQueenAudioProcessor::releaseResources()
@@ -156,57 +162,74 @@ void DrummerQueenAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
 
+    auto block_start_ms = juce::Time::getMillisecondCounterHiRes();
     auto num_samples = buffer.getNumSamples();
     auto buffer_length_seconds = num_samples / getSampleRate();
 
-    // Play note if requested
-    if (m_play_note != -1) {
-        midiMessages.addEvent(juce::MidiMessage::noteOn(1, m_play_note, juce::uint8(127)), 0);
-        m_play_note = -1;
+    reserve_output(midiMessages);
+
+    // Commands from the editor, such as auditioning a lane
+    AudioCommand command;
+    while (m_commands.pop(command)) {
+        auto sample_offset = (command.time_ms - m_block_start_ms) * getSampleRate() / 1000.;
+        auto sample_time = int(juce::jlimit(0., double(std::max(0, num_samples - 1)), sample_offset));
+        switch (command.type) {
+        case AudioCommand::NoteOn:
+            midiMessages.addEvent(juce::MidiMessage::noteOn(1, command.note, juce::uint8(command.velocity)), sample_time);
+            break;
+        case AudioCommand::NoteOff:
+            midiMessages.addEvent(juce::MidiMessage::noteOff(1, command.note), sample_time);
+            break;
+        case AudioCommand::AllNotesOff:
+            midiMessages.addEvent(juce::MidiMessage::allNotesOff(1), sample_time);
+            break;
+        }
     }
+    m_block_start_ms = block_start_ms;
 
-    m_bar_pos_beats = 0.;
+    m_bar_pos_beats.store(0., std::memory_order_relaxed);
+    m_playing.store(false, std::memory_order_relaxed);
 
     auto head = getPlayHead();
     if (!head) {
-        sendChangeMessage();
         return;
     }
     auto pos = head->getPosition();
 
 	if (pos && pos->getBpm()) {
-		m_bpm = *pos->getBpm();
+		m_bpm.store(*pos->getBpm(), std::memory_order_relaxed);
 	}
 
     if (!pos || !(pos->getIsPlaying() || pos->getIsRecording())) {
-        sendChangeMessage();
         return;
     }
     auto beat_pos_begin = pos->getPpqPosition();
     if (!beat_pos_begin) {
-        sendChangeMessage();
         return;
     }
 
-    m_bar_pos_beats = *beat_pos_begin;
+    auto const& playback = *m_data.acquire_playback();
+
+    m_bar_pos_beats.store(*beat_pos_begin, std::memory_order_relaxed);
+    m_playing.store(true, std::memory_order_relaxed);
+    m_sequence_pattern.store(playback.get_pattern(beats_to_ticks(*beat_pos_begin)), std::memory_order_relaxed);
 
     auto bpm = pos->getBpm();
     if (bpm) {
-		m_bpm = *bpm;
-        auto beat_length_seconds = 60. / m_bpm;
+        auto beat_length_seconds = 60. / *bpm;
         auto buffer_length_beats = buffer_length_seconds / beat_length_seconds;
 		auto sample_length_beats = buffer_length_beats / num_samples;
+        auto start_tick = beats_to_ticks(*beat_pos_begin);
+        auto end_tick = beats_to_ticks(*beat_pos_begin + buffer_length_beats);
 
         // Record incoming MIDI notes
         if (m_recording) {
             for (const auto& e : midiMessages) {
-                auto message = e.getMessage();
-                if (message.isNoteOn()) {
-                    double beat_time = *beat_pos_begin + (double)e.samplePosition * sample_length_beats;
-                    if (m_midi_messages.size() >= m_midi_messages.capacity()) {
-                        break;
-                    }
-                    m_midi_messages.emplace_back(beat_time, message.getNoteNumber(), message.getVelocity());
+                // Read the raw bytes: getMessage() allocates for long (sysex) messages
+                bool is_note_on = e.numBytes == 3 && (e.data[0] & 0xf0) == 0x90 && e.data[2] != 0;
+                if (is_note_on) {
+                    auto tick = beats_to_ticks(*beat_pos_begin + (double)e.samplePosition * sample_length_beats);
+                    m_recorded_midi.push({ tick, int(e.data[1]), int(e.data[2]) });
                 }
             }
         }
@@ -215,23 +238,51 @@ void DrummerQueenAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
 #ifndef JUCE_ADDED_PREROLL_CHECK
 		if (*pos->getTimeInSamples() == 0) {
             m_zero_position_buffer.clear();
-            m_data.get_events(0., buffer_length_beats, num_samples, m_zero_position_buffer);
+            render_events(playback, 0, end_tick - start_tick, num_samples, m_zero_position_buffer);
 		}
         else {
             if (!m_zero_position_buffer.isEmpty()) {
                 midiMessages.addEvents(m_zero_position_buffer, 0, num_samples, 0);
                 m_zero_position_buffer.clear();
             }
-            m_data.get_events(*beat_pos_begin, *beat_pos_begin + buffer_length_beats, num_samples, midiMessages);
+            render_events(playback, start_tick, end_tick, num_samples, midiMessages);
         }
 #else
         if (!pos->getInPreroll()) {
-            m_data.get_events(*beat_pos_begin, *beat_pos_begin + buffer_length_beats, num_samples, midiMessages);
+            render_events(playback, start_tick, end_tick, num_samples, midiMessages);
         }
 #endif
     }
-    sendChangeMessage();
+}
+
+void DrummerQueenAudioProcessor::reserve_output(juce::MidiBuffer& midiMessages)
+{
+    // Wrappers reserve only a little (2048 bytes for VST3), and adding past that
+    // would allocate. They keep reusing one MidiBuffer, so swapping the storage
+    // reserved in prepareToPlay into it once is enough.
+    auto needed = midiMessages.data.size() + MAX_OUTPUT_BYTES;
+    if (midiMessages.data.getNumAllocated() >= needed || m_spare_output_buffer.data.getNumAllocated() < needed) {
+        return;
+    }
+    m_spare_output_buffer.clear();
+    m_spare_output_buffer.addEvents(midiMessages, 0, -1, 0);
+    midiMessages.swapWith(m_spare_output_buffer);
+}
+
+void DrummerQueenAudioProcessor::render_events(PlaybackSnapshot const& playback, std::int64_t start_tick, std::int64_t end_tick, int num_samples, juce::MidiBuffer& midiMessages)
+{
+    if (m_lookahead.is_enabled()) {
+        m_lookahead.get_events(playback, m_cursor, start_tick, end_tick, num_samples, midiMessages);
+    }
+    else {
+        playback.get_events(m_cursor, start_tick, end_tick, num_samples, midiMessages);
+    }
+}
 
+void DrummerQueenAudioProcessor::set_lookahead_render(bool enabled)
+{
+    m_data.set_lookahead_render(enabled);
+    m_lookahead.set_enabled(enabled);
 }
 
 //==============================================================================
@@ -248,8 +299,8 @@ juce::AudioProcessorEditor* DrummerQueenAudioProcessor::createEditor()
 //==============================================================================
 void DrummerQueenAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
-	auto str = m_data.to_json();
-    destData.append(str.c_str(), str.size());
+	auto& state = m_data.get_state();
+    destData.append(state.data(), state.size());
 }
 
 void DrummerQueenAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -258,8 +309,20 @@ void DrummerQueenAudioProcessor::setStateInformation (const void* data, int size
         return;
     }
 
-    std::string state(static_cast<const char*>(data), sizeInBytes);
-	m_data.from_json(state);
+    if (DrumData::is_binary_state(data, sizeInBytes)) {
+        // A damaged state is ignored rather than half loaded
+        if (!m_data.from_binary(data, sizeInBytes)) {
+            return;
+        }
+    }
+    else {
+        // Saved before the binary format
+        std::string state(static_cast<const char*>(data), sizeInBytes);
+        if (!m_data.from_json(state)) {
+            return;
+        }
+    }
+    m_lookahead.set_enabled(m_data.lookahead_render());
 }
 
 //==============================================================================
@@ -2,11 +2,25 @@
 
 #include <JuceHeader.h>
 #include "DrumData.h"
+#include "LockFreeFifo.h"
+#include "LookaheadRenderer.h"
+
+// Sent from the message thread to processBlock. A command plays one block after it
+// was sent, as far into that block as time_ms was past the start of the block before,
+// so notes clicked in quick succession keep their spacing.
+struct AudioCommand
+{
+    enum Type { NoteOn, NoteOff, AllNotesOff };
+    Type type = NoteOn;
+    int note = 0;
+    int velocity = 0;
+    double time_ms = 0.;
+};
 
 //==============================================================================
 /**
 */
-class DrummerQueenAudioProcessor : public juce::AudioProcessor, public juce::ChangeBroadcaster, public DrumDataListener
+class DrummerQueenAudioProcessor : public juce::AudioProcessor, public DrumDataListener
 {
 public:
     //==============================================================================
@@ -46,32 +60,68 @@ public:
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
-    double barPos() const { return m_bar_pos_beats; }
-	double bpm() const { return m_bpm; }
+    // Transport state written by processBlock and polled by the editor
+    double barPos() const { return m_bar_pos_beats.load(std::memory_order_relaxed); }
+	double bpm() const { return m_bpm.load(std::memory_order_relaxed); }
+    bool isPlaying() const { return m_playing.load(std::memory_order_relaxed); }
+    int sequencePattern() const { return m_sequence_pattern.load(std::memory_order_relaxed); }
 
 	void changed() override { }
 
-	void play_note(int note) { m_play_note = note; }
+	void play_note(int note, int velocity = 127) { push_command({ AudioCommand::NoteOn, note, velocity }); }
+	void stop_note(int note) { push_command({ AudioCommand::NoteOff, note }); }
+	void all_notes_off() { push_command({ AudioCommand::AllNotesOff }); }
     std::vector<DrumEvent> get_recorded_midi() {
         std::vector<DrumEvent> midi_messages;
-		midi_messages.reserve(MAX_MIDI_MESSAGES);
-		midi_messages.swap(m_midi_messages);
+        DrumEvent e;
+        while (m_recorded_midi.pop(e)) {
+            midi_messages.push_back(e);
+        }
 		return midi_messages;
 	}
+    // Recorded notes lost because the editor fell behind
+    int dropped_recorded_midi() const { return m_recorded_midi.dropped(); }
 
     DrumData m_data;
 
 	void recording(bool r) { m_recording = r; }
 
+	bool lookahead_render() const { return m_lookahead.is_enabled(); }
+	void set_lookahead_render(bool enabled);
+
 private:
-    double m_bar_pos_beats = -1.;
-	double m_bpm = 120.;
+    std::atomic<double> m_bar_pos_beats = -1.;
+	std::atomic<double> m_bpm = 120.;
+    std::atomic<bool> m_playing = false;
+    std::atomic<int> m_sequence_pattern = -1;
     juce::AudioParameterFloat* m_swing;
-	int m_play_note = -1;
-	static constexpr int MAX_MIDI_MESSAGES = 32;
-	std::vector<DrumEvent> m_midi_messages;
+	static constexpr int COMMAND_CAPACITY = 256;
+	LockFreeFifo<AudioCommand> m_commands{ COMMAND_CAPACITY };
+	// When the previous block started, on the audio thread
+	double m_block_start_ms = 0.;
+	void push_command(AudioCommand command)
+	{
+		command.time_ms = juce::Time::getMillisecondCounterHiRes();
+		m_commands.push(command);
+	}
+	// Notes the editor can fall behind by before recording starts dropping them
+	static constexpr int RECORDED_MIDI_CAPACITY = 4096;
+    // Most events one block can emit: every hit of the longest pattern, on and off.
+    static constexpr int MAX_EVENTS_PER_BLOCK = MAX_LANES * MAX_DIVISIONS * 2;
+    // Bytes a MidiBuffer needs per short message: sample position, size and data.
+    static constexpr int MIDI_BUFFER_BYTES_PER_EVENT = sizeof(juce::int32) + sizeof(juce::uint16) + 3;
+    // Most bytes one block adds to the host's MidiBuffer: rendered events and every queued command
+    static constexpr int MAX_OUTPUT_BYTES = (MAX_EVENTS_PER_BLOCK + COMMAND_CAPACITY) * MIDI_BUFFER_BYTES_PER_EVENT;
+	LockFreeFifo<DrumEvent> m_recorded_midi{ RECORDED_MIDI_CAPACITY };
     bool m_recording = false;
     juce::MidiBuffer m_zero_position_buffer;
+    // Storage for the host's MidiBuffer, swapped in when the host's own is too small
+    juce::MidiBuffer m_spare_output_buffer;
+    PlaybackCursor m_cursor;
+    LookaheadRenderer m_lookahead{ m_data };
+
+    void reserve_output(juce::MidiBuffer& midiMessages);
+    void render_events(PlaybackSnapshot const& playback, std::int64_t start_tick, std::int64_t end_tick, int num_samples, juce::MidiBuffer& midiMessages);
 
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (DrummerQueenAudioProcessor)
@@ -0,0 +1,201 @@
+// Drives processBlock the way a host would while another thread edits, and fails
+// if the audio thread allocates or takes a lock. Allocations are caught by
+// replacing the global operator new and delete. Locks are caught by intercepting
+// pthread_mutex_lock, which JUCE's CriticalSection and std::mutex use on Linux and
+// macOS. Windows has no such hook, so only allocations are checked there.
+
+#include <JuceHeader.h>
+#include "PluginProcessor.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <thread>
+
+#if ! JUCE_WINDOWS
+#include <dlfcn.h>
+#include <pthread.h>
+#endif
+
+namespace
+{
+	// Set only on the thread calling processBlock, and only while it does
+	thread_local bool t_in_process_block = false;
+	std::atomic<int> g_allocations = 0;
+	std::atomic<int> g_deallocations = 0;
+	std::atomic<int> g_locks = 0;
+
+	void* allocate(std::size_t size)
+	{
+		if (t_in_process_block) {
+			g_allocations.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (auto p = std::malloc(size == 0 ? 1 : size)) {
+			return p;
+		}
+		throw std::bad_alloc();
+	}
+
+	void deallocate(void* p) noexcept
+	{
+		if (t_in_process_block && p) {
+			g_deallocations.fetch_add(1, std::memory_order_relaxed);
+		}
+		std::free(p);
+	}
+
+#if ! JUCE_WINDOWS
+	using MutexLock = int (*)(pthread_mutex_t*);
+	MutexLock g_real_mutex_lock = nullptr;
+
+	MutexLock real_mutex_lock()
+	{
+		// Also looked up in main, so dlsym never runs inside a checked block
+		if (!g_real_mutex_lock) {
+			g_real_mutex_lock = reinterpret_cast<MutexLock>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+		}
+		return g_real_mutex_lock;
+	}
+#endif
+
+	struct ScopedAudioThreadCheck
+	{
+		ScopedAudioThreadCheck() { t_in_process_block = true; }
+		~ScopedAudioThreadCheck() { t_in_process_block = false; }
+	};
+
+	class TestPlayHead : public juce::AudioPlayHead
+	{
+	public:
+		juce::Optional<PositionInfo> getPosition() const override { return m_position; }
+		PositionInfo m_position;
+	};
+}
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void operator delete(void* p) noexcept { deallocate(p); }
+void operator delete[](void* p) noexcept { deallocate(p); }
+void operator delete(void* p, std::size_t) noexcept { deallocate(p); }
+void operator delete[](void* p, std::size_t) noexcept { deallocate(p); }
+
+#if ! JUCE_WINDOWS
+extern "C" int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+	if (t_in_process_block) {
+		g_locks.fetch_add(1, std::memory_order_relaxed);
+	}
+	return real_mutex_lock()(mutex);
+}
+#endif
+
+namespace
+{
+	// Plays through the song in blocks of varying size, with the jitter and
+	// relocations hosts produce, while `edit` keeps changing the patterns
+	int run_blocks(DrummerQueenAudioProcessor& processor, bool lookahead)
+	{
+		constexpr double sample_rate = 48000.;
+		constexpr int max_block = 1024;
+		constexpr int num_blocks = 20000;
+		constexpr double bpm = 130.;
+
+		processor.set_lookahead_render(lookahead);
+		processor.recording(true);
+		processor.prepareToPlay(sample_rate, max_block);
+
+		TestPlayHead head;
+		head.m_position.setIsPlaying(true);
+		head.m_position.setBpm(bpm);
+		processor.setPlayHead(&head);
+
+		juce::AudioBuffer<float> buffer(2, max_block);
+		// Sized and reused as JUCE's VST3 wrapper does
+		juce::MidiBuffer midi;
+		midi.ensureSize(2048);
+
+		std::atomic<bool> done = false;
+		std::thread edit([&processor, &done] {
+			std::mt19937 rng(1);
+			auto& data = processor.m_data;
+			for (int i = 0; !done.load(std::memory_order_relaxed); ++i) {
+				data.set_current_pattern(int(rng() % 3));
+				// Only lanes the pattern has, as the grid allows
+				if (data.lane_count() > 0) {
+					data.set_hit(int(rng() % data.lane_count()), int(rng() % data.total_divisions()), int(rng() % 128));
+				}
+				if (i % 7 == 0) {
+					data.set_sequence_str(i % 2 ? "4(AB)C" : "A2(BC)");
+				}
+				if (i % 11 == 0) {
+					data.undo();
+				}
+				if (i % 13 == 0) {
+					processor.play_note(36 + int(rng() % 10));
+				}
+				processor.get_recorded_midi();
+				std::this_thread::sleep_for(std::chrono::microseconds(200));
+			}
+			});
+
+		std::mt19937 rng(2);
+		std::int64_t sample = 0;
+		double beat = 0.;
+		for (int block = 0; block < num_blocks; ++block) {
+			auto num_samples = 32 + int(rng() % (max_block - 32));
+			if (block % 2000 == 1999) {
+				// Relocate, as when the user clicks somewhere else on the timeline
+				beat = double(rng() % 64);
+			}
+			// Hosts round their position independently every block
+			auto jitter = (double(rng() % 3) - 1.) / TICKS_PER_BEAT;
+			head.m_position.setPpqPosition(beat + jitter);
+			head.m_position.setTimeInSamples(sample);
+			buffer.setSize(2, num_samples, false, false, true);
+			midi.clear();
+			// Sometimes enough incoming notes that the output no longer fits the host's buffer
+			for (int i = int(rng() % 230); i >= 0; --i) {
+				midi.addEvent(juce::MidiMessage::noteOn(1, 38, juce::uint8(100)), int(rng() % num_samples));
+			}
+			{
+				ScopedAudioThreadCheck check;
+				processor.processBlock(buffer, midi);
+			}
+			sample += num_samples;
+			beat += num_samples / sample_rate * bpm / 60.;
+		}
+
+		done = true;
+		edit.join();
+		processor.setPlayHead(nullptr);
+		processor.releaseResources();
+
+		auto failures = g_allocations.exchange(0) + g_deallocations.exchange(0) + g_locks.exchange(0);
+		std::printf("lookahead %d: %d blocks, %d realtime violations\n", int(lookahead), num_blocks, failures);
+		return failures;
+	}
+}
+
+int main()
+{
+#if ! JUCE_WINDOWS
+	if (!real_mutex_lock()) {
+		std::printf("pthread_mutex_lock not found\n");
+		return 1;
+	}
+#endif
+	juce::ScopedJuceInitialiser_GUI juce_init;
+	DrummerQueenAudioProcessor processor;
+	// The sequences the edit thread switches between play patterns A to C
+	for (int pattern = 1; pattern < 3; ++pattern) {
+		processor.m_data.set_current_pattern(pattern);
+		processor.m_data.add_drum("Kick", 36);
+		processor.m_data.add_drum("Snare", 38);
+	}
+	int failures = run_blocks(processor, false);
+	failures += run_blocks(processor, true);
+	processor.set_lookahead_render(false);
+	return failures == 0 ? 0 : 1;
+}